@@ -0,0 +1,1101 @@
+
+#include "lockfree-map.hh"
+#include "lockfree-executor.hh"
+#include "lockfree-frozen.hh"
+#include "lockfree-snapshot.hh"
+#include "lockfree-mapped.hh"
+#include "lockfree-shm.hh"
+#include "lockfree-feed.hh"
+#include "lockfree-wal.hh"
+#include "lockfree-replica.hh"
+#include "lockfree-tiered.hh"
+#include "lockfree-file-map.hh"
+#include "lockfree-varint.hh"
+#include "lockfree-aggregate.hh"
+#include "lockfree-join.hh"
+#include "lockfree-dedup.hh"
+#include "lockfree-interner.hh"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * Benchmarks for the lockfree map.
+ * Run `./bench` to run everything, or `./bench <name>...` to run selected benchmarks.
+ */
+
+using clock_type = std::chrono::steady_clock;
+
+double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+uint64_t hash_key(size_t key) {
+    return mix(key);
+}
+
+uint64_t hash_next(size_t prev) {
+    return mix(prev);
+}
+
+struct bench_value {
+    size_t key;
+    size_t count = 0;
+
+    bench_value(size_t key_) : key(key_) {}
+};
+
+template <typename MAP>
+size_t fill(MAP& map, size_t n, size_t first_key = 1) {
+    size_t placed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (map.get(first_key + i, hash_key, hash_next) != nullptr) {
+            ++placed;
+        }
+    }
+    return placed;
+}
+
+void report(const std::string& name, const std::string& what, double value, const std::string& unit) {
+    std::cout << name << ": " << what << " = " << value << " " << unit << std::endl;
+}
+
+/*** Iteration over sparse tables. ***/
+
+constexpr size_t ITERATE_SIZE = size_t(1) << 22;
+
+void bench_iterate() {
+    using map_t = lockfree::map<ITERATE_SIZE, size_t, bench_value>;
+
+    for (double fill_ratio : { 0.01, 0.10, 0.80 }) {
+        auto map = std::make_unique<map_t>();
+        size_t n = fill(*map, ITERATE_SIZE * fill_ratio);
+
+        // Baseline: the same density in a plain slot array, scanned slot by slot.
+        std::vector<std::atomic<bench_value*>> slots(ITERATE_SIZE);
+        for (bench_value& v : *map) {
+            slots[hash_key(v.key) % ITERATE_SIZE].store(&v, std::memory_order_relaxed);
+        }
+
+        auto start = clock_type::now();
+        size_t sum = 0;
+        for (auto& slot : slots) {
+            bench_value* v = slot.load(std::memory_order_relaxed);
+            if (v != nullptr) {
+                sum += v->key;
+            }
+        }
+        double naive = seconds_since(start);
+
+        start = clock_type::now();
+        size_t sum2 = 0;
+        for (bench_value& v : *map) {
+            sum2 += v.key;
+        }
+        double bitmap = seconds_since(start);
+
+        std::string name = "iterate fill=" + std::to_string(int(fill_ratio * 100)) + "% n=" + std::to_string(n);
+        report(name, "slot scan", naive * 1e3, "ms");
+        report(name, "bitmap scan", bitmap * 1e3, "ms");
+
+        if (sum == 0 || sum2 == 0) {
+            std::cout << "(empty)" << std::endl;
+        }
+    }
+}
+
+/*** Full parallel scan, like check() in test.cc. ***/
+
+constexpr size_t SCAN_SIZE = size_t(1) << 22;
+
+std::vector<size_t> thread_counts() {
+    std::vector<size_t> ret;
+    size_t hw = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t t = 1; t < hw; t *= 2) {
+        ret.push_back(t);
+    }
+    ret.push_back(hw);
+    return ret;
+}
+
+void bench_scan() {
+    using map_t = lockfree::map<SCAN_SIZE, size_t, bench_value>;
+
+    auto map = std::make_unique<map_t>();
+    size_t n = fill(*map, SCAN_SIZE / 2);
+
+    for (size_t threads : thread_counts()) {
+        lockfree::thread_executor pool(threads);
+
+        auto start = clock_type::now();
+        size_t total = map->transform_reduce(pool, size_t(0), std::plus<size_t>(), [](const bench_value& v) { return v.key; });
+        double t = seconds_since(start);
+
+        report("scan threads=" + std::to_string(threads) + " n=" + std::to_string(n), "transform_reduce", t * 1e3, "ms");
+
+        if (total == 0) {
+            std::cout << "(empty)" << std::endl;
+        }
+    }
+}
+
+/*** Work-stealing pool against a thread per chunk. ***/
+
+void bench_pool() {
+    constexpr size_t CALLS = 2000;
+
+    for (size_t threads : thread_counts()) {
+        lockfree::work_stealing_pool pool(threads);
+        lockfree::thread_executor naive(threads);
+        std::atomic<size_t> sink = 0;
+
+        auto spawn = [&](auto& executor) {
+            auto start = clock_type::now();
+            for (size_t i = 0; i < CALLS; ++i) {
+                executor.parallel_for(threads, [&](size_t j) { sink += j; });
+            }
+            return seconds_since(start) / CALLS;
+        };
+
+        std::string name = "pool threads=" + std::to_string(threads);
+        report(name, "parallel_for overhead, work stealing", spawn(pool) * 1e6, "us");
+        report(name, "parallel_for overhead, thread per chunk", spawn(naive) * 1e6, "us");
+    }
+
+    using map_t = lockfree::map<SCAN_SIZE, size_t, bench_value>;
+
+    auto map = std::make_unique<map_t>();
+    fill(*map, SCAN_SIZE / 2);
+
+    for (size_t threads : thread_counts()) {
+        lockfree::work_stealing_pool pool(threads);
+        lockfree::thread_executor naive(threads);
+
+        auto scan = [&](auto& executor) {
+            auto start = clock_type::now();
+            map->for_each(executor, [](bench_value& v) { ++v.count; });
+            return seconds_since(start);
+        };
+
+        std::string name = "pool threads=" + std::to_string(threads);
+        report(name, "for_each, work stealing", scan(pool) * 1e3, "ms");
+        report(name, "for_each, thread per chunk", scan(naive) * 1e3, "ms");
+    }
+}
+
+/*** Bulk load against one get() per key. ***/
+
+constexpr size_t LOAD_SIZE = size_t(1) << 23;
+
+std::vector<size_t> load_keys(size_t n) {
+    std::vector<size_t> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = mix(i) % (n * 2) + 1;
+    }
+    return keys;
+}
+
+void bench_load() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    std::vector<size_t> keys = load_keys(LOAD_SIZE / 2);
+
+    {
+        auto map = std::make_unique<map_t>();
+        auto start = clock_type::now();
+        for (size_t key : keys) {
+            map->get(key, hash_key, hash_next);
+        }
+        report("load n=" + std::to_string(keys.size()), "sequential get()", keys.size() / seconds_since(start) / 1e6, "Mkeys/s");
+    }
+
+    {
+        auto map = std::make_unique<map_t>();
+        auto start = clock_type::now();
+        {
+            auto builder = map->build_unsynchronized();
+            for (size_t key : keys) {
+                builder.get(key, hash_key, hash_next);
+            }
+            builder.publish();
+        }
+        report("load n=" + std::to_string(keys.size()), "build_unsynchronized()", keys.size() / seconds_since(start) / 1e6, "Mkeys/s");
+    }
+
+    for (size_t threads : thread_counts()) {
+        lockfree::work_stealing_pool pool(threads);
+        auto map = std::make_unique<map_t>();
+        auto start = clock_type::now();
+        map->bulk_insert(keys, hash_key, hash_next, pool);
+        report("load n=" + std::to_string(keys.size()) + " threads=" + std::to_string(threads), "bulk_insert()",
+               keys.size() / seconds_since(start) / 1e6, "Mkeys/s");
+    }
+}
+
+/*** Merging per-shard maps. ***/
+
+void bench_merge() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    constexpr size_t SHARDS = 4;
+    std::vector<size_t> keys = load_keys(LOAD_SIZE / 2);
+
+    std::vector<std::unique_ptr<map_t>> shards;
+    for (size_t s = 0; s < SHARDS; ++s) {
+        shards.emplace_back(std::make_unique<map_t>());
+        for (size_t i = s; i < keys.size(); i += SHARDS / 2) {
+            shards.back()->get(keys[i], hash_key, hash_next)->count += 1;
+        }
+    }
+
+    auto combine = [](bench_value& d, const bench_value& s) {
+        std::atomic_ref<size_t>(d.key).store(s.key, std::memory_order_relaxed);
+        std::atomic_ref<size_t>(d.count).fetch_add(s.count, std::memory_order_relaxed);
+    };
+
+    {
+        auto dst = std::make_unique<map_t>();
+        auto start = clock_type::now();
+        for (auto& shard : shards) {
+            for (bench_value& v : *shard) {
+                dst->get(v.key, hash_key, hash_next)->count += v.count;
+            }
+        }
+        report("merge shards=" + std::to_string(SHARDS), "iterate and get()", seconds_since(start) * 1e3, "ms");
+    }
+
+    for (size_t threads : thread_counts()) {
+        lockfree::work_stealing_pool pool(threads);
+        auto dst = std::make_unique<map_t>();
+        std::vector<map_t*> srcs;
+        for (auto& shard : shards) {
+            srcs.push_back(shard.get());
+        }
+
+        auto start = clock_type::now();
+        dst->merge_from(srcs, combine, hash_next, pool);
+        report("merge shards=" + std::to_string(SHARDS) + " threads=" + std::to_string(threads), "merge_from()", seconds_since(start) * 1e3, "ms");
+    }
+}
+
+/*** Frozen read-only tables against the live map. ***/
+
+// Raise to test larger tables; the frozen tables scale to about a billion entries.
+constexpr size_t FROZEN_SIZE = size_t(1) << 21;
+
+template <typename FIND>
+double lookups_per_second(const std::vector<size_t>& keys, FIND&& find) {
+    size_t found = 0;
+    auto start = clock_type::now();
+    for (size_t key : keys) {
+        found += (find(key) != nullptr);
+    }
+    double t = seconds_since(start);
+    if (found == 0) {
+        std::cout << "(nothing found)" << std::endl;
+    }
+    return keys.size() / t;
+}
+
+std::vector<size_t> lookup_keys(size_t n, size_t range) {
+    std::vector<size_t> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = mix(i + 12345) % range + 1;
+    }
+    return keys;
+}
+
+void bench_frozen() {
+    using map_t = lockfree::map<FROZEN_SIZE, size_t, bench_value>;
+
+    auto map = std::make_unique<map_t>();
+    size_t n = fill(*map, FROZEN_SIZE / 2);
+    std::vector<size_t> keys = lookup_keys(n, n);
+    std::string name = "frozen n=" + std::to_string(n);
+
+    auto start = clock_type::now();
+    auto mphf = lockfree::freeze(*map, [](const bench_value& v) { return v.count; });
+    report(name, "minimal perfect hash build", seconds_since(start) * 1e3, "ms");
+    report(name, "minimal perfect hash size", mphf.bits_per_entry(), "bits/entry");
+
+    start = clock_type::now();
+    auto sorted = lockfree::freeze_sorted(*map, [](const bench_value& v) { return v.count; });
+    report(name, "sorted index build", seconds_since(start) * 1e3, "ms");
+
+    report(name, "live map find()", lookups_per_second(keys, [&](size_t k) { return map->find(k, hash_key, hash_next); }) / 1e6, "Mlookups/s");
+    report(name, "minimal perfect hash find()", lookups_per_second(keys, [&](size_t k) { return mphf.find(k, hash_key); }) / 1e6, "Mlookups/s");
+    report(name, "sorted index find()", lookups_per_second(keys, [&](size_t k) { return sorted.find(k, hash_key); }) / 1e6, "Mlookups/s");
+}
+
+/*** Snapshot and restore. ***/
+
+std::string bench_path(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("lockfree-bench-" + name)).string();
+}
+
+void bench_snapshot() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    auto src = std::make_unique<map_t>();
+    src->bulk_insert(load_keys(LOAD_SIZE / 2), hash_key, hash_next);
+    std::string path = bench_path("snapshot");
+
+    for (size_t threads : thread_counts()) {
+        lockfree::work_stealing_pool pool(threads);
+        std::string name = "snapshot threads=" + std::to_string(threads);
+
+        auto start = clock_type::now();
+        auto written = lockfree::snapshot(*src, path, pool);
+        report(name, "write", written.bytes / seconds_since(start) / 1e9, "GB/s");
+
+        auto dst = std::make_unique<map_t>();
+        start = clock_type::now();
+        lockfree::restore(*dst, path, hash_next, pool);
+        report(name, "restore", written.bytes / seconds_since(start) / 1e9, "GB/s");
+    }
+
+    std::filesystem::remove(path);
+}
+
+/*** Packed snapshots. ***/
+
+void bench_packed() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    auto src = std::make_unique<map_t>();
+    src->bulk_insert(load_keys(LOAD_SIZE / 2), hash_key, hash_next);
+    for (auto& v : *src) {
+        v.count = mix(v.key) % 1000;
+    }
+    std::string path = bench_path("packed");
+
+    lockfree::work_stealing_pool pool(std::max<size_t>(std::thread::hardware_concurrency(), 1));
+    size_t raw_bytes = 0;
+
+    for (auto format : { lockfree::snapshot_format::raw, lockfree::snapshot_format::packed }) {
+        std::string name = std::string("snapshot format=") + (format == lockfree::snapshot_format::raw ? "raw" : "packed");
+
+        auto start = clock_type::now();
+        auto written = lockfree::snapshot(*src, path, pool, format);
+        double write = seconds_since(start);
+        raw_bytes = (format == lockfree::snapshot_format::raw ? written.bytes : raw_bytes);
+
+        // Throughput in bytes of raw records, so the two formats compare directly.
+        auto dst = std::make_unique<map_t>();
+        start = clock_type::now();
+        lockfree::restore(*dst, path, hash_next, pool);
+        double restore = seconds_since(start);
+
+        report(name, "file", written.bytes / 1e6, "MB");
+        report(name, "ratio", double(raw_bytes) / written.bytes, "x");
+        report(name, "write", raw_bytes / write / 1e9, "GB/s");
+        report(name, "restore", raw_bytes / restore / 1e9, "GB/s");
+    }
+    std::filesystem::remove(path);
+
+    // The decoder alone, on integers of mixed lengths.
+    std::vector<uint32_t> ints(size_t(1) << 24);
+    for (size_t i = 0; i < ints.size(); ++i) {
+        ints[i] = uint32_t(mix(i)) >> (8 * (mix(i) % 4));
+    }
+    std::vector<uint8_t> encoded(lockfree::varint::max_bytes(ints.size()));
+    size_t bytes = lockfree::varint::encode(ints.data(), ints.size(), encoded.data());
+
+    auto start = clock_type::now();
+    lockfree::varint::decode(encoded.data(), bytes, ints.size(), ints.data());
+    report("varint", "decode", ints.size() * sizeof(uint32_t) / seconds_since(start) / 1e9, "GB/s");
+}
+
+/*** Incremental checkpoints. ***/
+
+void bench_checkpoint() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    std::vector<size_t> keys = load_keys(LOAD_SIZE / 2);
+    std::string base = bench_path("checkpoint-base");
+    std::string delta = bench_path("checkpoint-delta");
+
+    for (bool tracking : { false, true }) {
+        auto m = std::make_unique<map_t>();
+        if (tracking) {
+            m->enable_dirty_tracking();
+        }
+        m->bulk_insert(keys, hash_key, hash_next);
+
+        std::string name = std::string("checkpoint tracking=") + (tracking ? "on" : "off");
+        auto start = clock_type::now();
+        for (size_t k : keys) {
+            m->get(k, hash_key, hash_next)->count += 1;
+        }
+        report(name, "get() updates", keys.size() / seconds_since(start) / 1e6, "Mops/s");
+
+        if (!tracking) {
+            continue;
+        }
+
+        start = clock_type::now();
+        auto full = lockfree::checkpoint(*m, base);
+        report(name, "full checkpoint", seconds_since(start) * 1e3, "ms");
+
+        // Random updates spread over the table: the delta size depends on how many regions they touch.
+        for (size_t every : { 10000, 100 }) {
+            for (size_t i = 0; i < keys.size(); i += every) {
+                m->get(keys[i], hash_key, hash_next)->count += 1;
+            }
+            std::string what = "delta of " + std::to_string(100.0 / every).substr(0, 4) + "% of keys";
+            start = clock_type::now();
+            auto written = lockfree::checkpoint_incremental(*m, delta);
+            report(name, what, seconds_since(start) * 1e3, "ms");
+            report(name, what + " size", 100.0 * written.bytes / full.bytes, "% of full");
+        }
+    }
+
+    std::filesystem::remove(base);
+    std::filesystem::remove(delta);
+}
+
+/*** Memory-mapped read-only view. ***/
+
+void bench_mapped() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    auto src = std::make_unique<map_t>();
+    std::vector<size_t> keys = load_keys(LOAD_SIZE / 2);
+    src->bulk_insert(keys, hash_key, hash_next);
+    std::string path = bench_path("mapped");
+
+    auto start = clock_type::now();
+    size_t bytes = lockfree::write_mapped(*src, path);
+    report("mapped", "write", bytes / seconds_since(start) / 1e9, "GB/s");
+
+    start = clock_type::now();
+    lockfree::mapped_view<bench_value> view(path);
+    report("mapped", "open", seconds_since(start) * 1e6, "us");
+
+    report("mapped", "live map find()", lookups_per_second(keys, [&](size_t k) { return src->find(k, hash_key, hash_next); }) / 1e6, "Mlookups/s");
+    report("mapped", "mapped_view find()", lookups_per_second(keys, [&](size_t k) { return view.find(k, hash_key, hash_next); }) / 1e6, "Mlookups/s");
+
+    std::filesystem::remove(path);
+}
+
+/*** Map shared by several processes. ***/
+
+void bench_shm() {
+    constexpr size_t KEYS = LOAD_SIZE / 4;
+    constexpr size_t OPS = size_t(1) << 23;
+
+    for (size_t procs : thread_counts()) {
+        auto m = std::make_unique<lockfree::shm_map<LOAD_SIZE, size_t, bench_value>>();
+        auto start = clock_type::now();
+
+        // Every process counts the same keys, so both new inserts and updates race across processes.
+        std::vector<pid_t> children;
+        for (size_t p = 0; p < procs; ++p) {
+            pid_t pid = ::fork();
+            if (pid == 0) {
+                for (size_t i = 0; i < OPS / procs; ++i) {
+                    bench_value* v = m->get(mix(i * procs + p) % KEYS, hash_key, hash_next);
+                    std::atomic_ref<size_t>(v->count).fetch_add(1, std::memory_order_relaxed);
+                }
+                ::_exit(0);
+            }
+            children.push_back(pid);
+        }
+        for (pid_t pid : children) {
+            ::waitpid(pid, nullptr, 0);
+        }
+
+        report("shm processes=" + std::to_string(procs), "get() updates", OPS / seconds_since(start) / 1e6, "Mops/s");
+    }
+}
+
+/*** Cost of the insert change feed. ***/
+
+void bench_feed() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+    using feed_t = lockfree::change_feed<bench_value>;
+
+    std::vector<size_t> keys = load_keys(LOAD_SIZE / 2);
+
+    auto run = [&](const std::string& what, feed_t* feed) {
+        auto map = std::make_unique<map_t>();
+        if (feed != nullptr) {
+            feed->subscribe(*map);
+        }
+
+        std::atomic<bool> done = false;
+        size_t received = 0;
+        std::thread consumer([&]() {
+            while (feed != nullptr && !done.load(std::memory_order_relaxed)) {
+                received += feed->poll([](size_t, bench_value*) {});
+            }
+        });
+
+        auto start = clock_type::now();
+        for (size_t key : keys) {
+            map->get(key, hash_key, hash_next);
+        }
+        double elapsed = seconds_since(start);
+        done = true;
+        consumer.join();
+
+        report("feed n=" + std::to_string(keys.size()), what, elapsed * 1e9 / keys.size(), "ns/get()");
+        if (feed != nullptr) {
+            report("feed n=" + std::to_string(keys.size()), what + " delivered", received + feed->poll([](size_t, bench_value*) {}), "events");
+            report("feed n=" + std::to_string(keys.size()), what + " dropped", feed->dropped(), "events");
+        }
+    };
+
+    run("no feed", nullptr);
+
+    feed_t drop(1 << 16, feed_t::overflow::drop);
+    run("overflow::drop", &drop);
+
+    feed_t block(1 << 16, feed_t::overflow::block);
+    run("overflow::block", &block);
+}
+
+/*** Write-ahead log with group commit. ***/
+
+void bench_wal() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    struct record {
+        size_t key;
+        size_t total;
+    };
+
+    constexpr size_t KEYS = LOAD_SIZE / 4;
+    constexpr size_t OPS = size_t(1) << 23;
+    std::string path = bench_path("wal");
+    size_t threads = thread_counts().back();
+
+    auto run = [&](const std::string& what, auto&& log) {
+        auto m = std::make_unique<map_t>();
+        auto start = clock_type::now();
+
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                for (size_t i = t; i < OPS; i += threads) {
+                    size_t key = mix(i) % KEYS;
+                    bench_value* v = m->get(key, hash_key, hash_next);
+                    log(record{ key, std::atomic_ref<size_t>(v->count).fetch_add(1, std::memory_order_relaxed) + 1 });
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+
+        report("wal threads=" + std::to_string(threads), what, seconds_since(start) * 1e9 * threads / OPS, "ns/update");
+    };
+
+    run("no log", [](const record&) {});
+
+    for (auto interval : { std::chrono::microseconds(100), std::chrono::microseconds(1000), std::chrono::microseconds(10000) }) {
+        std::filesystem::remove(path);
+        lockfree::wal<record> log(path, interval);
+        std::string what = "interval=" + std::to_string(interval.count()) + "us";
+
+        auto start = clock_type::now();
+        run(what, [&](const record& r) { log.append(r); });
+        log.flush();
+        double elapsed = seconds_since(start);
+
+        report("wal threads=" + std::to_string(threads), what + " updates", OPS / elapsed / 1e6, "Mupdates/s");
+        report("wal threads=" + std::to_string(threads), what + " commits", log.commits() / elapsed, "fdatasync/s");
+    }
+
+    std::filesystem::remove(path);
+}
+
+/*** Log-shipping replica. ***/
+
+void bench_replica() {
+    using map_t = lockfree::map<LOAD_SIZE, size_t, bench_value>;
+
+    struct record {
+        size_t key;
+        size_t total;
+    };
+
+    constexpr size_t KEYS = LOAD_SIZE / 4;
+    constexpr size_t OPS = size_t(1) << 23;
+    std::string path = bench_path("replica");
+    std::filesystem::remove(path);
+
+    auto src = std::make_unique<map_t>();
+    auto replica = std::make_unique<map_t>();
+    lockfree::wal<record> log(path, std::chrono::milliseconds(1));
+    lockfree::wal_follower<record> follower(path);
+
+    std::atomic<bool> done = false;
+    double max_lag = 0;
+    size_t applied = 0;
+
+    std::thread tail([&]() {
+        auto apply = [&](const record* r, size_t n) {
+            replica->bulk_emplace(n,
+                                  [&](size_t i) { return hash_key(r[i].key); },
+                                  [&](size_t i) {
+                                      bench_value v(r[i].key);
+                                      v.count = r[i].total;
+                                      return v;
+                                  },
+                                  [&](bench_value& v, size_t i) { v.count = std::max(v.count, r[i].total); },
+                                  hash_next, lockfree::default_pool());
+        };
+        while (!done.load()) {
+            max_lag = std::max(max_lag, follower.lag().seconds);
+            applied += follower.poll(apply);
+        }
+    });
+
+    auto start = clock_type::now();
+    for (size_t i = 0; i < OPS; ++i) {
+        size_t key = mix(i) % KEYS;
+        bench_value* v = src->get(key, hash_key, hash_next);
+        log.append({ key, ++v->count });
+    }
+    uint64_t last = log.flush();
+    double ingest = seconds_since(start);
+
+    while (follower.applied() < last) {
+        std::this_thread::yield();
+    }
+    double replicated = seconds_since(start);
+    done = true;
+    tail.join();
+
+    report("replica", "ingest", OPS / ingest / 1e6, "Mupdates/s");
+    report("replica", "replication", applied / replicated / 1e6, "Mrecords/s");
+    report("replica", "max lag", max_lag * 1e3, "ms");
+
+    std::filesystem::remove(path);
+}
+
+/*** Hot/cold tiers. ***/
+
+struct wide_value {
+    size_t key;
+    size_t count = 0;
+    char payload[112] = {};
+
+    wide_value(size_t key_) : key(key_) {}
+};
+
+void bench_tiered() {
+    constexpr size_t KEYS = size_t(1) << 21;
+    constexpr size_t OPS = size_t(1) << 23;
+    using tiered_t = lockfree::tiered_map<KEYS * 2, KEYS * 2, size_t, wide_value>;
+
+    std::string path = bench_path("tiered");
+
+    // 90% of the accesses go to 5% of the keys; every key is seen once first.
+    auto key_of = [](size_t i) {
+        uint64_t r = mix(i);
+        return (r % 10 < 9) ? (r >> 8) % (KEYS / 20) : (r >> 8) % KEYS;
+    };
+
+    for (size_t every : { size_t(0), OPS / 4, OPS / 16 }) {
+        auto t = std::make_unique<tiered_t>(path);
+        for (size_t k = 0; k < KEYS; ++k) {
+            t->get(k, hash_key, hash_next);
+        }
+
+        auto start = clock_type::now();
+        for (size_t i = 0; i < OPS; ++i) {
+            t->get(key_of(i), hash_key, hash_next)->count += 1;
+
+            if (every != 0 && i % every == every - 1) {
+                t->demote_cold(hash_next);
+                t->reclaim();
+            }
+        }
+        double elapsed = seconds_since(start);
+
+        auto stats = t->stats();
+        // Live elements: value plus hash for hot entries, an offset plus hash per indexed entry.
+        double bytes = stats.hot * (sizeof(wide_value) + 8.0) + stats.cold * 16.0;
+        std::string name = "tiered demote every=" + (every ? std::to_string(every) : std::string("never"));
+
+        report(name, "get()", OPS / elapsed / 1e6, "Mops/s");
+        report(name, "hot", stats.hot, "entries");
+        report(name, "element memory", bytes / 1e6, "MB");
+        report(name, "promoted", stats.promoted, "entries");
+        report(name, "file", stats.file_bytes / 1e6, "MB");
+    }
+
+    std::filesystem::remove(path);
+}
+
+/*** File-backed map. ***/
+
+size_t page_faults() {
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+/*
+ * Set LOCKFREE_BENCH_FILE_GB to a size 2-4 times the RAM of the machine, with the temp
+ * directory on a local SSD, to measure a table that does not fit in memory.
+ */
+template <size_t PAGE>
+void bench_file_map_with(const std::string& name, size_t keys, size_t lookups) {
+    std::string path = bench_path("file-map");
+    std::filesystem::remove(path);
+
+    {
+        lockfree::file_map<size_t, bench_value, PAGE> m(path, keys);
+
+        auto start = clock_type::now();
+        for (size_t k = 0; k < keys; ++k) {
+            m.get(k, hash_key, hash_next);
+        }
+        double load = seconds_since(start);
+
+        size_t faults = page_faults();
+        start = clock_type::now();
+        size_t found = 0;
+        for (size_t i = 0; i < lookups; ++i) {
+            found += (m.find(mix(i) % keys, hash_key, hash_next) != nullptr);
+        }
+        double lookup = seconds_since(start);
+        faults = page_faults() - faults;
+
+        report(name, "insert", keys / load / 1e6, "Mops/s");
+        report(name, "random find()", lookups / lookup / 1e6, "Mops/s");
+        report(name, "page faults per find()", double(faults) / lookups, "");
+        report(name, "file", m.bytes() / 1e9, "GB");
+
+        if (found != lookups) {
+            std::cout << "(missing keys)" << std::endl;
+        }
+    }
+
+    std::filesystem::remove(path);
+}
+
+void bench_file_map() {
+    const char* gb = std::getenv("LOCKFREE_BENCH_FILE_GB");
+    double bytes = (gb != nullptr ? std::atof(gb) : 0.25) * 1e9;
+
+    // Entries are a hash and a bench_value, at the default load factor of 0.7.
+    size_t keys = bytes * 0.7 / (sizeof(uint64_t) + sizeof(bench_value));
+    size_t lookups = std::min<size_t>(keys, size_t(1) << 22);
+
+    // One page per bucket against one entry per bucket, where every probe can land on another page.
+    bench_file_map_with<4096>("file_map buckets=page", keys, lookups);
+    bench_file_map_with<sizeof(uint64_t) + sizeof(bench_value)>("file_map buckets=entry", keys, lookups);
+}
+
+/*** GROUP BY aggregation. ***/
+
+void bench_group_by() {
+    using lockfree::agg;
+    using group_by_t = lockfree::group_by<size_t(1) << 21, size_t, int64_t, agg::sum, agg::count, agg::min, agg::max>;
+
+    constexpr size_t ROWS = size_t(1) << 24;
+    size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    lockfree::work_stealing_pool pool(threads);
+
+    std::vector<int64_t> values(ROWS);
+    for (size_t i = 0; i < ROWS; ++i) {
+        values[i] = mix(~i) % 1000;
+    }
+
+    for (size_t groups : { size_t(1000), size_t(1) << 20 }) {
+        std::vector<size_t> keys(ROWS);
+        for (size_t i = 0; i < ROWS; ++i) {
+            keys[i] = mix(i) % groups;
+        }
+        std::string name = "group_by groups=" + std::to_string(groups);
+
+        auto g = std::make_unique<group_by_t>();
+        auto start = clock_type::now();
+        g->consume(keys.data(), values.data(), ROWS, hash_key, hash_next, pool);
+        report(name, "shared map", ROWS / seconds_since(start) / 1e6, "Mrows/s");
+
+        // Baseline: one std::unordered_map per worker, merged at the end.
+        struct partial {
+            int64_t sum = 0;
+            uint64_t count = 0;
+            int64_t min = INT64_MAX;
+            int64_t max = INT64_MIN;
+        };
+        auto merge = [](partial& d, const partial& s) {
+            d.sum += s.sum;
+            d.count += s.count;
+            d.min = std::min(d.min, s.min);
+            d.max = std::max(d.max, s.max);
+        };
+
+        start = clock_type::now();
+        std::vector<std::unordered_map<size_t, partial>> locals(threads);
+        size_t chunk = (ROWS + threads - 1) / threads;
+        pool.parallel_for(threads, [&](size_t t) {
+            for (size_t i = t * chunk; i < std::min(ROWS, (t + 1) * chunk); ++i) {
+                merge(locals[t][keys[i]], partial{ values[i], 1, values[i], values[i] });
+            }
+        });
+        std::unordered_map<size_t, partial> merged = std::move(locals[0]);
+        for (size_t t = 1; t < threads; ++t) {
+            for (const auto& [ key, p ] : locals[t]) {
+                merge(merged[key], p);
+            }
+        }
+        report(name, "thread-local tables + merge", ROWS / seconds_since(start) / 1e6, "Mrows/s");
+
+        if (merged.size() != groups) {
+            std::cout << "(missing groups)" << std::endl;
+        }
+    }
+}
+
+/*** Hash join. ***/
+
+void bench_join() {
+    using join_t = lockfree::hash_join<size_t(1) << 22, size_t, size_t>;
+
+    constexpr size_t PROBES = size_t(1) << 24;
+    lockfree::work_stealing_pool pool(std::max<size_t>(std::thread::hardware_concurrency(), 1));
+
+    for (size_t build_size : { size_t(1) << 10, size_t(1) << 16, size_t(1) << 21 }) {
+        std::vector<size_t> build_keys(build_size);
+        std::vector<size_t> build_rows(build_size);
+        for (size_t i = 0; i < build_size; ++i) {
+            build_keys[i] = mix(i);
+            build_rows[i] = i;
+        }
+        // Half of the probes match.
+        std::vector<size_t> probe_keys(PROBES);
+        for (size_t i = 0; i < PROBES; ++i) {
+            probe_keys[i] = (i % 2 ? mix(mix(i) % build_size) : ~mix(i));
+        }
+
+        std::string name = "join build=" + std::to_string(build_size);
+        auto join = std::make_unique<join_t>();
+
+        auto start = clock_type::now();
+        join->build(build_keys.data(), build_rows.data(), build_size, hash_key, hash_next, pool);
+        report(name, "build", build_size / seconds_since(start) / 1e6, "Mrows/s");
+
+        for (auto mode : { lockfree::join_mode::inner, lockfree::join_mode::semi, lockfree::join_mode::anti }) {
+            start = clock_type::now();
+            auto out = join->probe(probe_keys.data(), PROBES, hash_key, hash_next, pool, mode);
+            double elapsed = seconds_since(start);
+
+            size_t n = 0;
+            for (const auto& part : out) {
+                n += part.size();
+            }
+            std::string what = (mode == lockfree::join_mode::inner ? "probe inner" : mode == lockfree::join_mode::semi ? "probe semi" : "probe anti");
+            report(name, what, PROBES / elapsed / 1e6, "Mrows/s");
+
+            if (n != PROBES / 2) {
+                std::cout << "(unexpected result size " << n << ")" << std::endl;
+            }
+        }
+    }
+}
+
+/*** Message deduplication. ***/
+
+void bench_dedup() {
+    constexpr size_t SLOTS = size_t(1) << 24;
+    constexpr size_t MESSAGES = size_t(1) << 26;
+    constexpr size_t PER_GENERATION = size_t(1) << 22;
+
+    size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+    // Message i carries a new id, except every tenth, which repeats an id from a little earlier.
+    auto id_of = [](size_t i) {
+        return (i % 10 == 9 && i > 5000) ? mix(i - 1 - mix(i) % 5000) : mix(i);
+    };
+
+    for (size_t bloom_bits : { size_t(0), size_t(1) << 26 }) {
+        auto seen = std::make_unique<lockfree::dedup_filter<SLOTS>>(2, bloom_bits);
+        std::string name = "dedup bloom=" + std::string(bloom_bits ? "on" : "off");
+        std::atomic<size_t> delivered = 0;
+
+        auto start = clock_type::now();
+        for (size_t first = 0; first < MESSAGES; first += PER_GENERATION) {
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t]() {
+                    size_t n = 0;
+                    for (size_t i = first + t; i < first + PER_GENERATION; i += threads) {
+                        n += seen->first_seen(hash_key(id_of(i)), hash_next);
+                    }
+                    delivered += n;
+                });
+            }
+            for (auto& w : workers) {
+                w.join();
+            }
+            seen->advance();
+        }
+        double elapsed = seconds_since(start);
+
+        report(name, "throughput", MESSAGES / elapsed / 1e6, "Mmsgs/s");
+        report(name, "delivered", 100.0 * delivered / MESSAGES, "%");
+        report(name, "memory", seen->memory() / 1e6, "MB");
+        report(name, "overflowed", seen->overflowed(), "ids");
+    }
+}
+
+/*** String interning. ***/
+
+// Includes the blocks malloc maps directly, like the arena chunks and the slot table.
+size_t heap_in_use() {
+    auto info = ::mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+void bench_interner() {
+    constexpr size_t LABELS = size_t(1) << 20;
+    constexpr size_t OPS = size_t(1) << 23;
+
+    size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    auto hash_sv = [](std::string_view s) { return mix(std::hash<std::string_view>()(s)); };
+
+    std::vector<std::string> labels(LABELS);
+    for (size_t i = 0; i < LABELS; ++i) {
+        labels[i] = "service=api,region=" + std::to_string(mix(i) % 100) + ",host=h" + std::to_string(i);
+    }
+
+    auto run = [&](const std::string& name, auto&& intern) {
+        auto start = clock_type::now();
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                for (size_t i = t; i < OPS; i += threads) {
+                    intern(labels[mix(i) % LABELS]);
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        report(name, "intern()", OPS / seconds_since(start) / 1e6, "Mops/s");
+    };
+
+    size_t before = heap_in_use();
+    {
+        auto interned = std::make_unique<lockfree::interner<size_t(1) << 21>>();
+        run("interner", [&](const std::string& s) { return interned->intern(s, hash_sv, hash_next).id; });
+        report("interner", "memory per string", double(heap_in_use() - before) / interned->size(), "bytes");
+    }
+
+    before = heap_in_use();
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, int> ids;
+        run("mutex + unordered_map", [&](const std::string& s) {
+            std::lock_guard lock(mutex);
+            return ids.emplace(s, ids.size()).first->second;
+        });
+        report("mutex + unordered_map", "memory per string", double(heap_in_use() - before) / ids.size(), "bytes");
+    }
+}
+
+/*** Top-k over a counter map against collecting and sorting everything. ***/
+
+constexpr size_t TOP_K_SIZE = size_t(1) << 24;
+
+void bench_top_k() {
+    using map_t = lockfree::map<TOP_K_SIZE, size_t, bench_value>;
+
+    auto map = std::make_unique<map_t>();
+    size_t n = fill(*map, TOP_K_SIZE / 2);
+    for (bench_value& v : *map) {
+        v.count = mix(v.key) % 1000000;
+    }
+    auto score = [](const bench_value& v) { return v.count; };
+
+    for (size_t threads : thread_counts()) {
+        lockfree::thread_executor pool(threads);
+        std::string name = "top-k threads=" + std::to_string(threads) + " n=" + std::to_string(n);
+
+        auto start = clock_type::now();
+        auto top = map->top_k(pool, 100, score);
+        report(name, "top_k(100)", seconds_since(start) * 1e3, "ms");
+
+        start = clock_type::now();
+        std::vector<std::pair<size_t, bench_value*>> all;
+        all.reserve(n);
+        for (bench_value& v : *map) {
+            all.emplace_back(v.count, &v);
+        }
+        std::sort(all.begin(), all.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        report(name, "collect and sort", seconds_since(start) * 1e3, "ms");
+
+        if (top.size() != 100 || top[0]->count != all[0].first || top[99]->count != all[99].first) {
+            std::cout << "(mismatch)" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+
+    std::vector<std::pair<std::string, std::function<void()>>> benches = {
+        { "iterate", bench_iterate },
+        { "scan", bench_scan },
+        { "pool", bench_pool },
+        { "load", bench_load },
+        { "merge", bench_merge },
+        { "frozen", bench_frozen },
+        { "snapshot", bench_snapshot },
+        { "packed", bench_packed },
+        { "checkpoint", bench_checkpoint },
+        { "mapped", bench_mapped },
+        { "shm", bench_shm },
+        { "feed", bench_feed },
+        { "wal", bench_wal },
+        { "replica", bench_replica },
+        { "tiered", bench_tiered },
+        { "file-map", bench_file_map },
+        { "group-by", bench_group_by },
+        { "join", bench_join },
+        { "dedup", bench_dedup },
+        { "interner", bench_interner },
+        { "top-k", bench_top_k },
+    };
+
+    for (const auto& [ name, fn ] : benches) {
+        bool selected = (argc < 2);
+        for (int i = 1; i < argc; ++i) {
+            if (name == argv[i]) {
+                selected = true;
+            }
+        }
+        if (selected) {
+            fn();
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+/*
+ * GROUP BY over columnar batches, aggregated into a lockfree map.
+ *
+ *   lockfree::group_by<1 << 20, uint64_t, double, lockfree::agg::sum, lockfree::agg::max, lockfree::agg::avg> g;
+ *   g.consume(user_ids.data(), amounts.data(), rows, hash1, hash2, pool);
+ *   ...
+ *   g.for_each([](const uint64_t& user, uint64_t rows, const auto& r) { double top = std::get<1>(r); ... });
+ *
+ * consume() cuts the columns into morsels of a few thousand rows, which the pool's workers
+ * take one at a time, so that skewed batches stay balanced. Within a morsel rows go in batches:
+ * the keys of the batch are hashed first, then the first slot of every hash is prefetched,
+ * then the groups in those slots, and only then are the rows probed and inserted, so that the
+ * cache misses of a batch overlap.
+ *
+ * Every group holds its key, a row count and one atomic slot per aggregate function, inline in
+ * the map's element. Updates are atomic adds (sum, avg) and compare-and-swap loops (min, max),
+ * so all threads aggregate into one table and no merge step is needed. Results can be read
+ * while rows are still being consumed; they are then as of some point during consume().
+ * Every result keeps its own type: T for sum, min and max, uint64_t for count, double for avg.
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "lockfree-map.hh"
+
+namespace lockfree {
+
+enum class agg { sum, count, min, max, avg };
+
+template <size_t SIZE, typename KEY, typename T, agg... FNS>
+class group_by {
+    static_assert(sizeof...(FNS) > 0, "At least one aggregate function is needed.");
+
+    static constexpr size_t N = sizeof...(FNS);
+    static constexpr std::array<agg, N> fns = { FNS... };
+
+    static constexpr size_t MORSEL = 16384;
+    static constexpr size_t BATCH = 64;
+
+public:
+
+    template <agg F>
+    using result_t = std::conditional_t<F == agg::count, uint64_t, std::conditional_t<F == agg::avg, double, T>>;
+
+    /* The aggregates in the order of FNS. */
+    using results_t = std::tuple<result_t<FNS>...>;
+
+    struct group {
+        KEY key;
+        std::atomic<uint64_t> rows = 0;
+        // Sums for sum and avg, extremes for min and max; unused for count.
+        std::array<std::atomic<T>, N> slots;
+
+        group(const KEY& key_) : key(key_) {
+            for (size_t f = 0; f < N; ++f) {
+                slots[f].store(fns[f] == agg::min ? std::numeric_limits<T>::max() :
+                               fns[f] == agg::max ? std::numeric_limits<T>::lowest() : T(0), std::memory_order_relaxed);
+            }
+        }
+
+        void add(T v) {
+            rows.fetch_add(1, std::memory_order_relaxed);
+
+            for (size_t f = 0; f < N; ++f) {
+                std::atomic<T>& s = slots[f];
+
+                if (fns[f] == agg::sum || fns[f] == agg::avg) {
+                    s.fetch_add(v, std::memory_order_relaxed);
+
+                } else if (fns[f] == agg::min) {
+                    T cur = s.load(std::memory_order_relaxed);
+                    while (v < cur && !s.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+
+                } else if (fns[f] == agg::max) {
+                    T cur = s.load(std::memory_order_relaxed);
+                    while (cur < v && !s.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+                }
+            }
+        }
+
+        /* The aggregates in the order of FNS; avg is the sum divided by the row count. */
+        results_t results() const {
+            uint64_t n = rows.load(std::memory_order_relaxed);
+            return [&]<size_t... F>(std::index_sequence<F...>) {
+                return results_t{ result<F>(n)... };
+            }(std::make_index_sequence<N>());
+        }
+
+    private:
+
+        template <size_t F>
+        std::tuple_element_t<F, results_t> result(uint64_t n) const {
+            T s = slots[F].load(std::memory_order_relaxed);
+            if constexpr (fns[F] == agg::count) {
+                return n;
+            } else if constexpr (fns[F] == agg::avg) {
+                return n ? (double)s / n : 0.0;
+            } else {
+                return s;
+            }
+        }
+    };
+
+private:
+
+    map<SIZE, KEY, group> table;
+
+    // Rows whose group could not be placed in the table.
+    std::atomic<size_t> lost = 0;
+
+    void consume_morsel(const KEY* keys, const T* values, size_t n, auto&& hashfun1, auto&& hashfun2, size_t maxtries) {
+        std::array<size_t, BATCH> hashes;
+        size_t failed = 0;
+
+        for (size_t first = 0; first < n; first += BATCH) {
+            size_t count = std::min(BATCH, n - first);
+
+            for (size_t i = 0; i < count; ++i) {
+                hashes[i] = hashfun1(keys[first + i]);
+                table.prefetch(hashes[i]);
+            }
+            for (size_t i = 0; i < count; ++i) {
+                table.prefetch_value(hashes[i]);
+            }
+            for (size_t i = 0; i < count; ++i) {
+                group* g = table.emplace_hashed(hashes[i], hashfun2, maxtries, keys[first + i]).first;
+                if (g == nullptr) {
+                    ++failed;
+                } else {
+                    g->add(values[first + i]);
+                }
+            }
+        }
+
+        if (failed > 0) {
+            lost.fetch_add(failed, std::memory_order_relaxed);
+        }
+    }
+
+public:
+
+    /* Aggregates n rows of the key and value columns; returns the number of rows that found no room in the table. */
+    size_t consume(const KEY* keys, const T* values, size_t n, auto&& hashfun1, auto&& hashfun2, auto&& pool, size_t maxtries = 32) {
+        size_t before = lost.load(std::memory_order_relaxed);
+        size_t morsels = (n + MORSEL - 1) / MORSEL;
+
+        pool.parallel_for(morsels, [&](size_t m) {
+            size_t first = m * MORSEL;
+            consume_morsel(keys + first, values + first, std::min(MORSEL, n - first), hashfun1, hashfun2, maxtries);
+        });
+
+        return lost.load(std::memory_order_relaxed) - before;
+    }
+
+    size_t consume(const KEY* keys, const T* values, size_t n, auto&& hashfun1, auto&& hashfun2) {
+        return consume(keys, values, n, hashfun1, hashfun2, default_pool());
+    }
+
+    /* The group of key, or a null pointer. */
+    const group* find(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return table.find(key, hashfun1, hashfun2, maxtries);
+    }
+
+    /* Calls fn(key, rows, results) for every group, in parallel on the pool. */
+    void for_each(auto&& pool, auto&& fn) {
+        table.for_each(pool, [&](group& g) {
+            fn(g.key, g.rows.load(std::memory_order_relaxed), g.results());
+        });
+    }
+
+    void for_each(auto&& fn) {
+        for (group& g : table) {
+            fn(g.key, g.rows.load(std::memory_order_relaxed), g.results());
+        }
+    }
+
+    /* Rows dropped so far because the table had no room for their group. */
+    size_t dropped() const {
+        return lost.load(std::memory_order_relaxed);
+    }
+
+    map<SIZE, KEY, group>& groups() {
+        return table;
+    }
+};
+
+}
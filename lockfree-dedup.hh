@@ -0,0 +1,237 @@
+#pragma once
+
+/*
+ * A deduplication filter for message ids: a hash-only set whose entries expire by generation.
+ *
+ *   lockfree::dedup_filter<1 << 26> seen(2);     // an id is remembered for 2 generations
+ *
+ *   if (seen.first_seen(hash1(id), hash2)) {
+ *       deliver(message);
+ *   }
+ *   ...
+ *   seen.advance();                              // e.g. once per second, from one thread
+ *
+ * Every slot is one 64-bit word: 48 bits of the hash and a 16-bit generation stamp. Probes
+ * go a cache line of 8 slots at a time, and on to another line chosen with hashfun2. An id is
+ * new when no live slot of its probe chain holds its hash; it is then stored with a
+ * compare-and-swap into the first free slot of the chain (empty, or holding an expired
+ * entry), and the thread whose compare-and-swap succeeds is the only one that sees it as new.
+ * Memory is the table and nothing else: expired slots are reused in place, so nothing is ever
+ * deleted, and advance() marks the entries that left the window so stamps can wrap around.
+ *
+ * Entries live for `window` generations. Two copies of an id that race across the instant
+ * of advance() may both be reported as new; copies further apart than the window are, too.
+ * Different ids with the same 48 hash bits are taken for duplicates.
+ *
+ * With bloom_bits > 0 every generation also gets a Bloom filter. An id that no live filter
+ * knows (the common case for a stream of mostly new ids) is stored in the first free slot
+ * without scanning the rest of its chain.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "lockfree-executor.hh"
+
+namespace lockfree {
+
+template <size_t SIZE>
+class dedup_filter {
+    static constexpr size_t LINE = 8;
+    static_assert(SIZE % LINE == 0, "The table is made of whole cache lines.");
+    static constexpr size_t LINES = SIZE / LINE;
+
+    static constexpr uint64_t STAMP_BITS = 16;
+    static constexpr uint64_t STAMP_MASK = (uint64_t(1) << STAMP_BITS) - 1;
+    // Stamps run from 1 to STAMPS; 0 marks an expired entry.
+    static constexpr uint64_t STAMPS = STAMP_MASK;
+    static constexpr uint64_t EXPIRED = 0;
+
+    struct alignas(64) line {
+        std::atomic<uint64_t> slots[LINE];
+    };
+
+    std::unique_ptr<line[]> lines;
+    size_t window;
+
+    // One filter per generation in a ring of window + 1, so the one being cleared is never read.
+    size_t bloom_words;
+    std::unique_ptr<std::atomic<uint64_t>[]> blooms;
+
+    std::atomic<uint64_t> generation = 0;
+    std::atomic<size_t> overflows = 0;
+
+    static uint64_t fingerprint(size_t hash) {
+        // Never 0, so that a stored entry is never an empty slot.
+        return ((uint64_t)hash >> STAMP_BITS) | 1;
+    }
+
+    static uint64_t stamp_of(uint64_t gen) {
+        return gen % STAMPS + 1;
+    }
+
+    // A stamp ahead of gen was written by a thread that already saw the next generation: it is live.
+    bool live(uint64_t slot, uint64_t gen) const {
+        uint64_t stamp = slot & STAMP_MASK;
+        uint64_t age = (stamp_of(gen) + STAMPS - stamp) % STAMPS;
+        return stamp != EXPIRED && (age < window || age > STAMPS / 2);
+    }
+
+    std::atomic<uint64_t>* bloom_of(uint64_t gen) const {
+        return &blooms[(gen % (window + 1)) * bloom_words];
+    }
+
+    // Two bits per id, from the bits of the hash that do not pick the slot.
+    std::pair<size_t, size_t> bloom_bits_of(size_t hash) const {
+        size_t bits = bloom_words * 64;
+        return { (hash >> 20) % bits, std::rotl((uint64_t)hash, 29) % bits };
+    }
+
+    bool maybe_seen(size_t hash, uint64_t gen) const {
+        auto [ a, b ] = bloom_bits_of(hash);
+        for (uint64_t g = gen + 1 - window; g <= gen; ++g) {
+            std::atomic<uint64_t>* bloom = bloom_of(g);
+            if ((bloom[a / 64].load(std::memory_order_acquire) >> (a % 64) & 1) &&
+                (bloom[b / 64].load(std::memory_order_acquire) >> (b % 64) & 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void remember(size_t hash, uint64_t gen) {
+        auto [ a, b ] = bloom_bits_of(hash);
+        std::atomic<uint64_t>* bloom = bloom_of(gen);
+        bloom[a / 64].fetch_or(uint64_t(1) << (a % 64), std::memory_order_release);
+        bloom[b / 64].fetch_or(uint64_t(1) << (b % 64), std::memory_order_release);
+    }
+
+public:
+
+    /* Ids are remembered for window generations (at least 1); bloom_bits is the size of each Bloom filter, 0 for none. */
+    explicit dedup_filter(size_t window_ = 2, size_t bloom_bits = 0)
+        : lines(std::make_unique<line[]>(LINES)), window(std::max<size_t>(window_, 1)),
+          bloom_words((bloom_bits + 63) / 64) {
+
+        if (window >= STAMPS / 2) {
+            throw std::runtime_error("Deduplication window too long.");
+        }
+        if (bloom_words > 0) {
+            blooms = std::make_unique<std::atomic<uint64_t>[]>(bloom_words * (window + 1));
+        }
+        // Start far enough in that the window never reaches before generation 0.
+        generation.store(window, std::memory_order_relaxed);
+    }
+
+    /* Whether this is the first time the id with this hash is seen within the window. */
+    bool first_seen(size_t hash, auto&& hashfun2, size_t maxtries = 8) {
+        uint64_t gen = generation.load(std::memory_order_acquire);
+        uint64_t fp = fingerprint(hash);
+        uint64_t entry = (fp << STAMP_BITS) | stamp_of(gen);
+
+        // Set the bits first: a racing copy of the id then either sees them or sees the slot taken.
+        bool scan_all = true;
+        if (bloom_words > 0) {
+            scan_all = maybe_seen(hash, gen);
+            remember(hash, gen);
+        }
+
+        while (true) {
+            std::atomic<uint64_t>* free = nullptr;
+            uint64_t free_was = 0;
+            size_t hash2 = hash;
+            bool end = false;
+
+            for (size_t tries = 0; tries < maxtries && !end; ++tries) {
+                line& l = lines[hash2 % LINES];
+                size_t i = (hash2 / LINES) % LINE;
+
+                for (size_t n = 0; n < LINE; ++n, i = (i + 1) % LINE) {
+                    uint64_t s = l.slots[i].load(std::memory_order_acquire);
+
+                    if (s == 0) {
+                        if (free == nullptr) {
+                            free = &l.slots[i];
+                            free_was = 0;
+                        }
+                        end = true;
+                        break;
+                    }
+                    if (live(s, gen)) {
+                        if ((s >> STAMP_BITS) == fp) {
+                            return false;
+                        }
+                    } else if (free == nullptr) {
+                        free = &l.slots[i];
+                        free_was = s;
+                        if (!scan_all) {
+                            end = true;
+                            break;
+                        }
+                    }
+                }
+                hash2 = hashfun2(hash2);
+            }
+
+            if (free == nullptr) {
+                overflows.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            if (free->compare_exchange_strong(free_was, entry, std::memory_order_acq_rel)) {
+                return true;
+            }
+            // The chain changed under us; look again.
+        }
+    }
+
+    /*
+     * Starts a new generation; ids of the oldest one are forgotten.
+     * Call from one thread at a time; this sweeps the table on the pool.
+     */
+    void advance(auto&& pool) {
+        uint64_t gen = generation.load(std::memory_order_relaxed) + 1;
+
+        if (bloom_words > 0) {
+            std::atomic<uint64_t>* bloom = bloom_of(gen);
+            for (size_t w = 0; w < bloom_words; ++w) {
+                bloom[w].store(0, std::memory_order_relaxed);
+            }
+        }
+        generation.store(gen, std::memory_order_release);
+
+        // Mark what expired, so that its stamp is not mistaken for a live one when stamps wrap.
+        size_t parts = pool.concurrency() * 4;
+        size_t part = (LINES + parts - 1) / parts;
+        pool.parallel_for(parts, [&](size_t p) {
+            for (size_t l = p * part; l < std::min(LINES, (p + 1) * part); ++l) {
+                for (std::atomic<uint64_t>& slot : lines[l].slots) {
+                    uint64_t s = slot.load(std::memory_order_relaxed);
+                    if (s != 0 && (s & STAMP_MASK) != EXPIRED && !live(s, gen)) {
+                        slot.compare_exchange_strong(s, s & ~STAMP_MASK, std::memory_order_relaxed);
+                    }
+                }
+            }
+        });
+    }
+
+    void advance() {
+        advance(default_pool());
+    }
+
+    /* Ids reported as new because their probe chain had no free slot. */
+    size_t overflowed() const {
+        return overflows.load(std::memory_order_relaxed);
+    }
+
+    /* Bytes of the table and the Bloom filters. */
+    size_t memory() const {
+        return (SIZE + bloom_words * (window + 1)) * sizeof(uint64_t);
+    }
+};
+
+}
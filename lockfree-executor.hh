@@ -0,0 +1,425 @@
+#pragma once
+
+/*
+ * Executors for the bulk operations of the lockfree map.
+ * Any type with these two members can be used as an executor:
+ *
+ *   size_t concurrency() const;                  // how many tasks can usefully run at once
+ *   void parallel_for(size_t n, auto&& fn);      // calls fn(i) for every i in [0, n), returns when all are done
+ *
+ * Bulk operations that are not given an executor use default_pool().
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace lockfree {
+
+/* Runs everything in the calling thread. */
+struct inline_executor {
+
+    size_t concurrency() const {
+        return 1;
+    }
+
+    void parallel_for(size_t n, auto&& fn) {
+        for (size_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+    }
+};
+
+/* Spawns a fresh set of threads for every call. */
+struct thread_executor {
+    size_t threads;
+
+    thread_executor(size_t threads_ = std::thread::hardware_concurrency()) : threads(std::max<size_t>(threads_, 1)) {}
+
+    size_t concurrency() const {
+        return threads;
+    }
+
+    void parallel_for(size_t n, auto&& fn) {
+        std::atomic<size_t> next = 0;
+        std::exception_ptr error;
+        std::atomic_flag failed;
+
+        auto work = [&]() {
+            try {
+                for (size_t i = next++; i < n; i = next++) {
+                    fn(i);
+                }
+            } catch (...) {
+                if (!failed.test_and_set()) {
+                    error = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < std::min(threads, n); ++t) {
+            workers.emplace_back(work);
+        }
+        work();
+
+        for (auto& w : workers) {
+            w.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+/*
+ * Work-stealing thread pool.
+ * Every worker owns a Chase-Lev deque; parallel_for() ranges are split in halves,
+ * the owner keeps working on one half and leaves the other for thieves.
+ * Calls from outside the pool are handed over through a small lock-free inbox and
+ * the calling thread blocks until the work is done; calls from inside a worker
+ * (nested bulk operations) are pushed onto the worker's own deque and the worker
+ * keeps executing tasks until its call completes.
+ */
+class work_stealing_pool {
+
+    struct job;
+
+    struct task {
+        job* owner;
+        size_t lo;
+        size_t hi;
+    };
+
+    struct job {
+        void (*run)(void* fn, size_t lo, size_t hi);
+        void* fn;
+        size_t grain;
+        std::atomic<size_t> pending;
+        std::atomic<bool> done = false;
+        std::unique_ptr<task[]> tasks;
+        std::atomic<size_t> ntasks = 0;
+        std::exception_ptr error;
+        std::atomic_flag failed;
+
+        task* make_task(size_t lo, size_t hi) {
+            task* t = &tasks[ntasks++];
+            t->owner = this;
+            t->lo = lo;
+            t->hi = hi;
+            return t;
+        }
+    };
+
+    /* Chase-Lev deque with a fixed capacity; push() fails instead of growing. */
+    struct deque {
+        static constexpr int64_t CAPACITY = 1024;
+
+        alignas(64) std::atomic<int64_t> top = 0;
+        alignas(64) std::atomic<int64_t> bottom = 0;
+        std::array<std::atomic<task*>, CAPACITY> buffer;
+
+        // Only meaningful for the owner: thieves can only make it less full.
+        bool full() const {
+            return bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_acquire) >= CAPACITY;
+        }
+
+        bool push(task* t) {
+            if (full()) {
+                return false;
+            }
+
+            int64_t b = bottom.load(std::memory_order_relaxed);
+
+            buffer[b % CAPACITY].store(t, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        task* pop() {
+            int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t tp = top.load(std::memory_order_relaxed);
+
+            if (tp > b) {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            task* t = buffer[b % CAPACITY].load(std::memory_order_relaxed);
+
+            if (tp == b) {
+                if (!top.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    t = nullptr;
+                }
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return t;
+        }
+
+        task* steal() {
+            int64_t tp = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = bottom.load(std::memory_order_acquire);
+
+            if (tp >= b) {
+                return nullptr;
+            }
+
+            task* t = buffer[tp % CAPACITY].load(std::memory_order_relaxed);
+
+            if (!top.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return t;
+        }
+    };
+
+    static constexpr size_t INBOX = 64;
+
+    std::vector<std::unique_ptr<deque>> deques;
+    std::array<std::atomic<task*>, INBOX> inbox;
+    std::vector<std::thread> workers;
+
+    std::atomic<bool> stopping = false;
+    std::atomic<uint32_t> epoch = 0;
+    std::atomic<size_t> sleeping = 0;
+    std::atomic<uint32_t> completed = 0;
+
+    static size_t& this_worker() {
+        static thread_local size_t index = SIZE_MAX;
+        return index;
+    }
+
+    static const work_stealing_pool*& this_pool() {
+        static thread_local const work_stealing_pool* pool = nullptr;
+        return pool;
+    }
+
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed) > 0) {
+            epoch.fetch_add(1);
+            epoch.notify_all();
+        }
+    }
+
+    task* find_task(size_t self) {
+        if (self != SIZE_MAX) {
+            if (task* t = deques[self]->pop()) {
+                return t;
+            }
+        }
+
+        for (auto& slot : inbox) {
+            task* t = slot.load(std::memory_order_relaxed);
+            if (t != nullptr && slot.compare_exchange_strong(t, nullptr, std::memory_order_acquire)) {
+                return t;
+            }
+        }
+
+        size_t n = deques.size();
+        size_t start = (self == SIZE_MAX ? 0 : self + 1);
+        for (size_t i = 0; i < n; ++i) {
+            size_t victim = (start + i) % n;
+            if (victim == self) {
+                continue;
+            }
+            if (task* t = deques[victim]->steal()) {
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    void execute(task* t, size_t self) {
+        job* j = t->owner;
+        size_t lo = t->lo;
+        size_t hi = t->hi;
+
+        while (hi - lo > j->grain && !deques[self]->full()) {
+            size_t mid = lo + (hi - lo) / 2;
+            deques[self]->push(j->make_task(mid, hi));
+            hi = mid;
+            wake();
+        }
+
+        try {
+            j->run(j->fn, lo, hi);
+        } catch (...) {
+            if (!j->failed.test_and_set()) {
+                j->error = std::current_exception();
+            }
+        }
+
+        if (j->pending.fetch_sub(hi - lo) == hi - lo) {
+            // The caller may destroy the job as soon as it sees this, so it is the last touch.
+            j->done.store(true, std::memory_order_release);
+            completed.fetch_add(1);
+            completed.notify_all();
+        }
+    }
+
+    void worker(size_t self) {
+        this_worker() = self;
+        this_pool() = this;
+
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (task* t = find_task(self)) {
+                execute(t, self);
+                continue;
+            }
+
+            if (spin()) {
+                continue;
+            }
+
+            uint32_t e = epoch.load();
+            sleeping.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (task* t = find_task(self)) {
+                sleeping.fetch_sub(1);
+                execute(t, self);
+                continue;
+            }
+
+            if (!stopping.load()) {
+                epoch.wait(e);
+            }
+            sleeping.fetch_sub(1);
+        }
+    }
+
+    // Briefly wait for work before going to sleep, so back-to-back calls don't pay for a wakeup.
+    bool spin() {
+        for (size_t i = 0; i < 64; ++i) {
+            std::this_thread::yield();
+            for (auto& slot : inbox) {
+                if (slot.load(std::memory_order_relaxed) != nullptr) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    size_t current_worker() const {
+        return (this_pool() == this) ? this_worker() : SIZE_MAX;
+    }
+
+public:
+
+    work_stealing_pool(size_t threads = std::thread::hardware_concurrency()) {
+        threads = std::max<size_t>(threads, 1);
+
+        for (size_t i = 0; i < threads; ++i) {
+            deques.emplace_back(std::make_unique<deque>());
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this, i]() { worker(i); });
+        }
+    }
+
+    ~work_stealing_pool() {
+        stopping.store(true);
+        epoch.fetch_add(1);
+        epoch.notify_all();
+
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    size_t concurrency() const {
+        return workers.size();
+    }
+
+    void parallel_for(size_t n, auto&& fn, size_t grain = 1) {
+        if (n == 0) {
+            return;
+        }
+
+        using F = std::remove_reference_t<decltype(fn)>;
+
+        job j;
+        j.run = [](void* f, size_t lo, size_t hi) {
+            for (size_t i = lo; i < hi; ++i) {
+                (*static_cast<F*>(f))(i);
+            }
+        };
+        j.fn = (void*)&fn;
+        j.grain = std::max<size_t>(grain, 1);
+        j.pending = n;
+        // Every split makes one task out of a range longer than the grain.
+        j.tasks = std::make_unique<task[]>(2 * (n / j.grain) + 2);
+
+        task* root = j.make_task(0, n);
+        size_t self = current_worker();
+
+        if (self != SIZE_MAX) {
+            if (deques[self]->push(root)) {
+                wake();
+            } else {
+                execute(root, self);
+            }
+
+            // Keep working (on anything) until our own call is finished.
+            while (!j.done.load(std::memory_order_acquire)) {
+                if (task* t = find_task(self)) {
+                    execute(t, self);
+                }
+            }
+
+        } else {
+            bool posted = false;
+            while (!posted) {
+                for (auto& slot : inbox) {
+                    task* empty = nullptr;
+                    if (slot.compare_exchange_strong(empty, root, std::memory_order_release)) {
+                        posted = true;
+                        break;
+                    }
+                }
+                if (!posted) {
+                    std::this_thread::yield();
+                }
+            }
+
+            epoch.fetch_add(1);
+            epoch.notify_all();
+
+            while (true) {
+                uint32_t c = completed.load();
+                if (j.done.load(std::memory_order_acquire)) {
+                    break;
+                }
+                completed.wait(c);
+            }
+        }
+
+        if (j.error) {
+            std::rethrow_exception(j.error);
+        }
+    }
+};
+
+/* The pool used by bulk operations that are not given an executor explicitly. */
+inline work_stealing_pool& default_pool() {
+    static work_stealing_pool pool;
+    return pool;
+}
+
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+/*
+ * A feed of the keys inserted into a lockfree map, for consumers that index new entries
+ * without rescanning the map.
+ *
+ *   lockfree::change_feed<counter_t> feed(1 << 16);
+ *   feed.subscribe(my_map);
+ *   ...
+ *   feed.poll([](size_t hash, counter_t* value) { ... });
+ *
+ * The thread that wins the insert pushes (hash, value pointer) into a bounded multi-producer,
+ * multi-consumer ring (Vyukov's queue: one sequence number per cell, so producers and
+ * consumers only contend on their own index). When the ring is full, the insert either drops
+ * the event and counts it (overflow::drop, inserts never wait), or waits until a consumer
+ * makes room (overflow::block). Updates of existing entries are not reported.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "lockfree-map.hh"
+
+namespace lockfree {
+
+/* Bounded lock-free MPMC queue; the capacity is rounded up to a power of two. */
+template <typename T>
+class ring {
+
+    struct cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+
+    std::unique_ptr<cell[]> cells;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+
+public:
+
+    explicit ring(size_t capacity) : mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1) {
+        cells = std::make_unique<cell[]>(mask + 1);
+        for (size_t i = 0; i <= mask; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(const T& v) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+
+        while (true) {
+            cell& c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.data = v;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T& v) {
+        size_t pos = head.load(std::memory_order_relaxed);
+
+        while (true) {
+            cell& c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    v = c.data;
+                    c.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t capacity() const {
+        return mask + 1;
+    }
+};
+
+template <typename VALUE>
+class change_feed {
+public:
+
+    enum class overflow { drop, block };
+
+    struct change {
+        size_t hash;
+        VALUE* value;
+    };
+
+private:
+
+    ring<change> events;
+    overflow policy;
+    alignas(64) std::atomic<size_t> lost = 0;
+
+    static void hook(void* ctx, size_t hash, VALUE* value) {
+        ((change_feed*)ctx)->publish(hash, value);
+    }
+
+public:
+
+    explicit change_feed(size_t capacity, overflow policy_ = overflow::drop) : events(capacity), policy(policy_) {}
+
+    change_feed(const change_feed&) = delete;
+    change_feed& operator=(const change_feed&) = delete;
+
+    /* Starts receiving the inserts of m; call before m is shared, and keep the feed alive as long as m. */
+    template <size_t SIZE, typename KEY>
+    void subscribe(map<SIZE, KEY, VALUE>& m) {
+        m.on_insert(&hook, this);
+    }
+
+    void publish(size_t hash, VALUE* value) {
+        if (events.try_push({ hash, value })) {
+            return;
+        }
+        if (policy == overflow::drop) {
+            lost.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        while (!events.try_push({ hash, value })) {
+            std::this_thread::yield();
+        }
+    }
+
+    /* Calls fn(hash, value) for up to max pending inserts, oldest first; returns how many there were. */
+    size_t poll(auto&& fn, size_t max = SIZE_MAX) {
+        change c;
+        size_t n = 0;
+        while (n < max && events.try_pop(c)) {
+            fn(c.hash, c.value);
+            ++n;
+        }
+        return n;
+    }
+
+    /* Events dropped because the ring was full (overflow::drop only). */
+    size_t dropped() const {
+        return lost.load(std::memory_order_relaxed);
+    }
+};
+
+}
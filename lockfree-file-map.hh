@@ -0,0 +1,330 @@
+#pragma once
+
+/*
+ * A lockfree map stored in a sparse file mapped with MAP_SHARED, for tables larger than RAM:
+ * the page cache keeps the pages in use and writes the others back to the file.
+ *
+ * The table is an array of buckets of one page each, and entries are stored inline in their
+ * bucket, so a lookup that finds its key in the first bucket touches a single page. A bucket
+ * is probed linearly, wrapping around, from an entry chosen by the high bits of the hash;
+ * when it is full the probe goes on to another bucket chosen with
+ * hashfun2, as in map. Pages of buckets that never received an entry are never written.
+ * PAGE can be made smaller for tables of small entries that are known to fit in memory.
+ *
+ * An entry is claimed by a compare-and-swap of its hash word from empty to busy, filled in,
+ * and published by storing the hash. A lookup of the same hash that sees it busy waits for
+ * the publishing store, so a key is inserted exactly once. A writer that dies in between
+ * leaves the entry busy: waiting for it is an error after BUSY_TIMEOUT, and the next open of
+ * the file by a process that has it to itself frees the entry again.
+ *
+ * The file can be opened again later (or by another process at the same time): the table is
+ * reused when its layout matches. Every open file_map holds a shared lock on the file (an
+ * open file description lock, so this is per file_map, not per process), which is how an
+ * open tells that it is alone. KEY and VALUE must be trivially copyable.
+ *
+ * Errors are reported with std::runtime_error.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "lockfree-snapshot.hh"
+
+namespace lockfree {
+
+struct file_map_header {
+    char magic[8] = { 'L', 'F', 'M', 'A', 'P', 'F', 'I', 'L' };
+    uint32_t version = 1;
+    uint32_t entry_size = 0;
+    uint64_t page_size = 0;
+    uint64_t buckets = 0;
+};
+
+template <typename KEY, typename VALUE, size_t PAGE = 4096>
+class file_map {
+    static_assert(std::is_trivially_copyable_v<KEY> && std::is_trivially_copyable_v<VALUE>,
+                  "File maps store keys and values as raw bytes.");
+    static_assert(std::atomic_ref<uint64_t>::is_always_lock_free, "Entries must be lock-free across processes.");
+
+    struct entry {
+        uint64_t hash;
+        VALUE val;
+    };
+
+    static constexpr size_t PER_BUCKET = PAGE / sizeof(entry);
+    static_assert(PER_BUCKET > 0, "VALUE does not fit in a page.");
+    static_assert(PAGE % alignof(entry) == 0, "Buckets must keep their entries aligned.");
+
+    // Hash words of empty entries and of entries being filled in; real hashes are moved out of the way.
+    static constexpr uint64_t EMPTY = 0;
+    static constexpr uint64_t BUSY = 1;
+
+    // Filling in an entry takes microseconds; an entry busy for this long lost its writer.
+    static constexpr auto BUSY_TIMEOUT = std::chrono::seconds(10);
+
+    // Bytes of the file locked by open file_maps: OPENING exclusively while a file_map is being
+    // opened, IN_USE shared for as long as it is open.
+    static constexpr off_t OPENING = 0;
+    static constexpr off_t IN_USE = 1;
+
+    io::file f;
+    io::mapping data;
+    size_t buckets = 0;
+    size_t reclaimed = 0;
+
+    static uint64_t stored(size_t hash) {
+        return hash <= BUSY ? hash + 2 : hash;
+    }
+
+    // The header takes the first page, or as many buckets as it needs when they are smaller.
+    static constexpr size_t FIRST = (sizeof(file_map_header) + PAGE - 1) / PAGE * PAGE;
+
+    entry* bucket(size_t b) const {
+        return (entry*)(data.data + FIRST + PAGE * b);
+    }
+
+    static size_t first_entry(size_t hash) {
+        return (hash >> 32) % PER_BUCKET;
+    }
+
+    static std::atomic_ref<uint64_t> hash_of(entry& e) {
+        return std::atomic_ref<uint64_t>(e.hash);
+    }
+
+    // Returns the hash word of e once it is not busy.
+    static uint64_t settled(entry& e) {
+        uint64_t h = hash_of(e).load(std::memory_order_acquire);
+        if (h != BUSY) {
+            return h;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + BUSY_TIMEOUT;
+        while (h == BUSY) {
+            if (std::chrono::steady_clock::now() > deadline) {
+                throw std::runtime_error("File map entry stayed busy; its writer may have died.");
+            }
+            std::this_thread::yield();
+            h = hash_of(e).load(std::memory_order_acquire);
+        }
+        return h;
+    }
+
+    // Returns false instead of waiting when wait is false and the lock is held elsewhere.
+    static bool lock(const io::file& f, short type, off_t byte, bool wait = true) {
+        struct flock l = {};
+        l.l_type = type;
+        l.l_whence = SEEK_SET;
+        l.l_start = byte;
+        l.l_len = 1;
+
+        while (::fcntl(f.fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &l) < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (!wait && (errno == EAGAIN || errno == EACCES)) {
+                return false;
+            }
+            io::fail("Could not lock", f.path);
+        }
+        return true;
+    }
+
+    // Frees the entries left busy by writers that died; only called when no one else has the file open.
+    void reclaim_busy() {
+        for (size_t b = 0; b < buckets; ++b) {
+            off_t at = FIRST + PAGE * b;
+            off_t next = ::lseek(f.fd, at, SEEK_DATA);
+
+            // Holes hold no entries: skip to the next data, if the file system can tell.
+            if (next < 0 && errno == ENXIO) {
+                return;
+            } else if (next > at) {
+                b = (next - FIRST) / PAGE;
+                if (b >= buckets) {
+                    return;
+                }
+            }
+
+            entry* e = bucket(b);
+            for (size_t i = 0; i < PER_BUCKET; ++i) {
+                if (hash_of(e[i]).load(std::memory_order_relaxed) == BUSY) {
+                    hash_of(e[i]).store(EMPTY, std::memory_order_relaxed);
+                    ++reclaimed;
+                }
+            }
+        }
+    }
+
+    static size_t bucket_count(size_t capacity, double load) {
+        return std::max<size_t>((size_t)(capacity / load / PER_BUCKET) + 1, 1);
+    }
+
+    // An empty file gets its header and its size before it is mapped; any other file keeps both.
+    // Openers take turns, so two of them never both see the file empty.
+    static const io::file& created(const io::file& f, size_t buckets) {
+        lock(f, F_WRLCK, OPENING);
+        if (f.size() == 0) {
+            file_map_header header;
+            header.entry_size = sizeof(entry);
+            header.page_size = PAGE;
+            header.buckets = buckets;
+            f.pwrite_all(&header, sizeof(header), 0);
+            f.resize(FIRST + PAGE * buckets);
+        }
+        return f;
+    }
+
+public:
+
+    /*
+     * Opens the table in the file at path, or creates it with room for about capacity entries
+     * at the given load factor. The file is sparse: its pages are only allocated when written.
+     */
+    file_map(const std::string& path, size_t capacity, double load = 0.7)
+        : f(path, O_RDWR | O_CREAT), data(created(f, bucket_count(capacity, load)), true) {
+
+        file_map_header header;
+        if (data.size < sizeof(header)) {
+            throw std::runtime_error("Not a file map: " + path);
+        }
+        file_map_header existing = io::load<file_map_header>(data.data);
+
+        if (std::memcmp(existing.magic, header.magic, sizeof(header.magic)) != 0 || existing.version != 1 ||
+            existing.entry_size != sizeof(entry) || existing.page_size != PAGE) {
+            throw std::runtime_error("Not a file map with this layout: " + path);
+        }
+        if (existing.buckets == 0 || data.size < FIRST || existing.buckets > (data.size - FIRST) / PAGE) {
+            throw std::runtime_error("Truncated file map: " + path);
+        }
+        header = existing;
+
+        buckets = header.buckets;
+
+        if (lock(f, F_WRLCK, IN_USE, false)) {
+            reclaim_busy();
+        }
+        lock(f, F_RDLCK, IN_USE);
+        lock(f, F_UNLCK, OPENING);
+
+        // Lookups jump to random pages; read-ahead would only evict useful ones.
+        ::madvise(data.data, data.size, MADV_RANDOM);
+    }
+
+    VALUE* get(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return emplace_hashed(hashfun1(key), hashfun2, maxtries, key).first;
+    }
+
+    VALUE* find(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return find_hashed(hashfun1(key), hashfun2, maxtries);
+    }
+
+    VALUE* find_hashed(size_t hash, auto&& hashfun2, size_t maxtries = 32) {
+        uint64_t want = stored(hash);
+        size_t hash2 = hash;
+
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            entry* b = bucket(hash2 % buckets);
+            size_t i = first_entry(hash2);
+
+            for (size_t n = 0; n < PER_BUCKET; ++n, i = (i + 1 == PER_BUCKET ? 0 : i + 1)) {
+                uint64_t h = settled(b[i]);
+
+                if (h == EMPTY) {
+                    return nullptr;
+                } else if (h == want) {
+                    return &b[i].val;
+                }
+            }
+            hash2 = hashfun2(hash2);
+        }
+        return nullptr;
+    }
+
+    /* Like map::emplace_hashed(): the value is constructed from args; returns it and whether this call inserted it. */
+    template <typename... Args>
+    std::pair<VALUE*, bool> emplace_hashed(size_t hash, auto&& hashfun2, size_t maxtries, Args&&... args) {
+        uint64_t want = stored(hash);
+        size_t hash2 = hash;
+
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            entry* b = bucket(hash2 % buckets);
+            size_t i = first_entry(hash2);
+
+            for (size_t n = 0; n < PER_BUCKET; ++n, i = (i + 1 == PER_BUCKET ? 0 : i + 1)) {
+                uint64_t h = settled(b[i]);
+
+                if (h == EMPTY) {
+                    if (hash_of(b[i]).compare_exchange_strong(h, BUSY, std::memory_order_acquire)) {
+                        try {
+                            new (&b[i].val) VALUE(std::forward<Args>(args)...);
+                        } catch (...) {
+                            hash_of(b[i]).store(EMPTY, std::memory_order_release);
+                            throw;
+                        }
+                        hash_of(b[i]).store(want, std::memory_order_release);
+                        return { &b[i].val, true };
+                    }
+                    // Someone else claimed it: look at it again once it is published.
+                    h = settled(b[i]);
+                }
+
+                if (h == want) {
+                    return { &b[i].val, false };
+                }
+            }
+            hash2 = hashfun2(hash2);
+        }
+        return { nullptr, false };
+    }
+
+    /* Calls fn(hash, value) for every entry, with hashes 0 and 1 reported as 2 and 3; this reads the whole file. */
+    void for_each(auto&& fn) {
+        for (size_t b = 0; b < buckets; ++b) {
+            entry* e = bucket(b);
+            for (size_t i = 0; i < PER_BUCKET; ++i) {
+                uint64_t h = settled(e[i]);
+                if (h != EMPTY) {
+                    fn(h, e[i].val);
+                }
+            }
+        }
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for_each([&](uint64_t, const VALUE&) { ++n; });
+        return n;
+    }
+
+    /* Writes the dirty pages back to the file and waits for them. */
+    void flush() {
+        if (::msync(data.data, data.size, MS_SYNC) < 0) {
+            io::fail("Could not sync", f.path);
+        }
+    }
+
+    /* Entries left busy by dead writers that were freed when this file_map opened the file. */
+    size_t reclaimed_entries() const {
+        return reclaimed;
+    }
+
+    /* Bytes of the file, most of which may be holes. */
+    size_t bytes() const {
+        return data.size;
+    }
+};
+
+}
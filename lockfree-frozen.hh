@@ -0,0 +1,375 @@
+#pragma once
+
+/*
+ * Immutable read-only snapshots of a lockfree map, for maps that stop receiving new keys.
+ *
+ * frozen_map indexes the stored hashes with a minimal perfect hash function (BBHash-style:
+ * a cascade of bit arrays, one bit per hash and level, with ranks to turn the bit position
+ * into a dense index), and keeps the values in a dense array.
+ * A lookup is one hash mix per level (almost always just the first one or two), one read of
+ * the bit array with its rank and one read of the entry; there are no atomics.
+ * Like the map, a lookup only compares hashes, never keys.
+ *
+ * sorted_map keeps the hashes sorted, in Eytzinger (BFS) layout: the search walks down an
+ * implicit binary tree whose top levels stay in cache, and the next levels are prefetched while
+ * the current one is compared, so lookups have predictable latency. Entries can also be visited
+ * in hash order, which makes set operations between two sorted_maps a linear merge.
+ */
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "lockfree-map.hh"
+
+namespace lockfree {
+
+template <typename T>
+class frozen_map {
+public:
+
+    struct entry {
+        size_t hash;
+        T val;
+    };
+
+private:
+
+    static constexpr size_t MAX_LEVELS = 32;
+
+    // Bits and their running rank side by side, so that a lookup touches one cache line.
+    struct word {
+        uint64_t bits = 0;
+        uint64_t rank = 0;
+    };
+
+    struct level {
+        std::vector<word> words;
+        size_t slots;
+    };
+
+    std::vector<level> levels;
+    std::vector<entry> entries;
+
+    // The few hashes that still collided after the last level, sorted by hash.
+    std::vector<std::pair<size_t, size_t>> fallback;
+
+    static size_t position(size_t hash, size_t lvl, size_t slots) {
+        uint64_t x = (hash ^ (lvl * 0x9e3779b97f4a7c15)) * 0xbf58476d1ce4e5b9;
+        x ^= x >> 31;
+        return (size_t)(((unsigned __int128)x * slots) >> 64);
+    }
+
+    size_t index_of(size_t hash) const {
+        for (size_t l = 0; l < levels.size(); ++l) {
+            const level& lv = levels[l];
+            size_t pos = position(hash, l, lv.slots);
+            const word& w = lv.words[pos / 64];
+            uint64_t bit = uint64_t(1) << (pos % 64);
+
+            if (w.bits & bit) {
+                return w.rank + std::popcount(w.bits & (bit - 1));
+            }
+        }
+
+        auto i = std::lower_bound(fallback.begin(), fallback.end(), std::make_pair(hash, size_t(0)));
+        if (i != fallback.end() && i->first == hash) {
+            return i->second;
+        }
+        return SIZE_MAX;
+    }
+
+public:
+
+    frozen_map() {}
+
+    /* Builds from (hash, value) pairs with distinct hashes; gamma trades bits per key for build and lookup speed. */
+    frozen_map(std::vector<entry> items, double gamma = 2.0) {
+        std::vector<size_t> keys;
+        keys.reserve(items.size());
+        for (const entry& e : items) {
+            keys.push_back(e.hash);
+        }
+
+        size_t rank = 0;
+
+        for (size_t l = 0; l < MAX_LEVELS && !keys.empty(); ++l) {
+            level lv;
+            lv.slots = std::max<size_t>((size_t)(keys.size() * gamma + 63) / 64 * 64, 64);
+            lv.words.resize(lv.slots / 64);
+            std::vector<uint64_t> collided(lv.slots / 64);
+
+            for (size_t hash : keys) {
+                size_t pos = position(hash, l, lv.slots);
+                uint64_t bit = uint64_t(1) << (pos % 64);
+
+                if (lv.words[pos / 64].bits & bit) {
+                    collided[pos / 64] |= bit;
+                } else {
+                    lv.words[pos / 64].bits |= bit;
+                }
+            }
+
+            for (size_t w = 0; w < lv.words.size(); ++w) {
+                lv.words[w].bits &= ~collided[w];
+                lv.words[w].rank = rank;
+                rank += std::popcount(lv.words[w].bits);
+            }
+
+            std::vector<size_t> next;
+            for (size_t hash : keys) {
+                size_t pos = position(hash, l, lv.slots);
+                if (collided[pos / 64] & (uint64_t(1) << (pos % 64))) {
+                    next.push_back(hash);
+                }
+            }
+
+            levels.push_back(std::move(lv));
+            keys.swap(next);
+        }
+
+        for (size_t hash : keys) {
+            fallback.emplace_back(hash, rank++);
+        }
+        std::sort(fallback.begin(), fallback.end());
+
+        std::vector<entry> placed;
+        placed.reserve(items.size());
+        std::vector<size_t> where(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            where[i] = index_of(items[i].hash);
+        }
+
+        // Entries are moved into their slots in index order.
+        std::vector<size_t> order(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            order[where[i]] = i;
+        }
+        for (size_t i : order) {
+            placed.push_back(std::move(items[i]));
+        }
+        entries = std::move(placed);
+    }
+
+    const T* find_hashed(size_t hash) const {
+        size_t i = index_of(hash);
+
+        if (i >= entries.size() || entries[i].hash != hash) {
+            return nullptr;
+        }
+        return &entries[i].val;
+    }
+
+    template <typename KEY>
+    const T* find(const KEY& key, auto&& hashfun1) const {
+        return find_hashed(hashfun1(key));
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    /* Bits per entry spent on the perfect hash function itself. */
+    double bits_per_entry() const {
+        size_t bits = 0;
+        for (const level& lv : levels) {
+            bits += lv.words.size() * sizeof(word) * 8;
+        }
+        bits += fallback.size() * sizeof(fallback[0]) * 8;
+        return entries.empty() ? 0 : double(bits) / entries.size();
+    }
+
+    auto begin() const {
+        return entries.begin();
+    }
+
+    auto end() const {
+        return entries.end();
+    }
+};
+
+template <typename T>
+class sorted_map {
+
+    // 1-based Eytzinger layout; tree[k] has children 2k and 2k+1. tree[0] is unused.
+    std::vector<size_t> tree;
+    // For every tree position, the index of its value; values are kept in hash order.
+    std::vector<uint32_t> rank;
+    std::vector<T> values;
+
+    size_t first_position() const {
+        size_t k = 1;
+        while (2 * k < tree.size()) {
+            k *= 2;
+        }
+        return k;
+    }
+
+    // In-order successor in the implicit tree; returns 0 past the end.
+    size_t next_position(size_t k) const {
+        if (2 * k + 1 < tree.size()) {
+            k = 2 * k + 1;
+            while (2 * k < tree.size()) {
+                k *= 2;
+            }
+            return k;
+        }
+        while (k & 1) {
+            k >>= 1;
+        }
+        return k >> 1;
+    }
+
+    void fill(const std::vector<size_t>& sorted, size_t& i, size_t k) {
+        if (k < tree.size()) {
+            fill(sorted, i, 2 * k);
+            tree[k] = sorted[i];
+            rank[k] = i++;
+            fill(sorted, i, 2 * k + 1);
+        }
+    }
+
+public:
+
+    sorted_map() {}
+
+    /* Builds from (hash, value) pairs with distinct hashes. */
+    sorted_map(std::vector<typename frozen_map<T>::entry> items) {
+        std::sort(items.begin(), items.end(), [](const auto& a, const auto& b) { return a.hash < b.hash; });
+
+        std::vector<size_t> sorted;
+        sorted.reserve(items.size());
+        values.reserve(items.size());
+        for (auto& e : items) {
+            sorted.push_back(e.hash);
+            values.push_back(std::move(e.val));
+        }
+
+        tree.resize(items.size() + 1);
+        rank.resize(items.size() + 1);
+        size_t i = 0;
+        fill(sorted, i, 1);
+    }
+
+    const T* find_hashed(size_t hash) const {
+        const size_t* t = tree.data();
+        size_t n = tree.size();
+        size_t k = 1;
+
+        while (k < n) {
+            // The 16 descendants four levels down are 128 contiguous bytes; prefetching never faults.
+            __builtin_prefetch(t + 16 * k);
+            __builtin_prefetch(t + 16 * k + 8);
+            k = 2 * k + (t[k] < hash);
+        }
+        // Undo the right turns taken after the last left turn; that node is the lower bound.
+        k >>= std::countr_one(k) + 1;
+
+        if (k == 0 || t[k] != hash) {
+            return nullptr;
+        }
+        return &values[rank[k]];
+    }
+
+    template <typename KEY>
+    const T* find(const KEY& key, auto&& hashfun1) const {
+        return find_hashed(hashfun1(key));
+    }
+
+    size_t size() const {
+        return values.size();
+    }
+
+    /* Calls fn(hash, value) for every entry, in increasing hash order. */
+    void for_each_ordered(auto&& fn) const {
+        if (values.empty()) {
+            return;
+        }
+        for (size_t k = first_position(); k != 0; k = next_position(k)) {
+            fn(tree[k], values[rank[k]]);
+        }
+    }
+
+    /* Calls fn(hash, a_value, b_value) for every hash present in both, in hash order. */
+    friend void set_intersection(const sorted_map& a, const sorted_map& b, auto&& fn) {
+        if (a.values.empty() || b.values.empty()) {
+            return;
+        }
+
+        size_t i = a.first_position();
+        size_t j = b.first_position();
+
+        while (i != 0 && j != 0) {
+            if (a.tree[i] < b.tree[j]) {
+                i = a.next_position(i);
+            } else if (b.tree[j] < a.tree[i]) {
+                j = b.next_position(j);
+            } else {
+                fn(a.tree[i], a.values[a.rank[i]], b.values[b.rank[j]]);
+                i = a.next_position(i);
+                j = b.next_position(j);
+            }
+        }
+    }
+
+    /* Calls fn(hash, a_value) for every hash present in a but not in b, in hash order. */
+    friend void set_difference(const sorted_map& a, const sorted_map& b, auto&& fn) {
+        if (a.values.empty()) {
+            return;
+        }
+
+        size_t i = a.first_position();
+        size_t j = b.values.empty() ? 0 : b.first_position();
+
+        while (i != 0) {
+            if (j == 0 || a.tree[i] < b.tree[j]) {
+                fn(a.tree[i], a.values[a.rank[i]]);
+                i = a.next_position(i);
+            } else if (b.tree[j] < a.tree[i]) {
+                j = b.next_position(j);
+            } else {
+                i = a.next_position(i);
+                j = b.next_position(j);
+            }
+        }
+    }
+};
+
+/* Builds a frozen_map from the current contents of a map, with project(value) as the stored value. */
+template <size_t SIZE, typename KEY, typename VALUE>
+auto freeze(map<SIZE, KEY, VALUE>& m, auto&& project, double gamma = 2.0) {
+    using T = std::decay_t<decltype(project(std::declval<const VALUE&>()))>;
+
+    std::vector<typename frozen_map<T>::entry> items;
+    for (auto i = m.begin(); i != m.end(); ++i) {
+        items.push_back({ i.hash(), project(*i) });
+    }
+    return frozen_map<T>(std::move(items), gamma);
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+frozen_map<VALUE> freeze(map<SIZE, KEY, VALUE>& m) {
+    return freeze(m, [](const VALUE& v) { return v; });
+}
+
+/* Builds a sorted_map from the current contents of a map, with project(value) as the stored value. */
+template <size_t SIZE, typename KEY, typename VALUE>
+auto freeze_sorted(map<SIZE, KEY, VALUE>& m, auto&& project) {
+    using T = std::decay_t<decltype(project(std::declval<const VALUE&>()))>;
+
+    std::vector<typename frozen_map<T>::entry> items;
+    for (auto i = m.begin(); i != m.end(); ++i) {
+        items.push_back({ i.hash(), project(*i) });
+    }
+    return sorted_map<T>(std::move(items));
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+sorted_map<VALUE> freeze_sorted(map<SIZE, KEY, VALUE>& m) {
+    return freeze_sorted(m, [](const VALUE& v) { return v; });
+}
+
+}
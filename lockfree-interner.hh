@@ -0,0 +1,274 @@
+#pragma once
+
+/*
+ * A concurrent string interner: every distinct string gets a dense 32-bit id and one stable copy.
+ *
+ *   lockfree::interner<1 << 22> labels;
+ *   auto [ id, text ] = labels.intern(label, hash1, hash2);     // text stays valid as long as labels
+ *   std::string_view same = labels.lookup(id);
+ *
+ * Strings are copied into an append-only arena made of large chunks, one chunk per thread at a
+ * time, so copying takes no shared writes. The lockfree map holds one element per string with
+ * a view of the copy. The thread whose insert wins the map's compare-and-swap takes the next id
+ * and writes the element into a directory indexed by id, which makes lookup() two array reads;
+ * threads that find the element wait until its id is set. A thread that loses the race gives
+ * its copy back to its chunk.
+ *
+ * Different strings with the same hash are told apart by comparing the text: the string that
+ * comes second moves on to a new hash derived with hashfun2, and so on, the same way for every
+ * thread, so a string always ends up under the same hash.
+ *
+ * Nothing is ever removed. Errors (a full table, more than 2^32 - 1 strings) are reported with
+ * std::runtime_error.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lockfree-map.hh"
+
+namespace lockfree {
+
+template <size_t SIZE>
+class interner {
+
+    static constexpr uint32_t UNSET = UINT32_MAX;
+    static constexpr size_t CHUNK = size_t(1) << 20;
+    static constexpr size_t BLOCK_BITS = 16;
+    static constexpr size_t BLOCK = size_t(1) << BLOCK_BITS;
+    static constexpr size_t BLOCKS = (size_t(UNSET) + BLOCK - 1) / BLOCK;
+
+    struct entry {
+        std::string_view text;
+        std::atomic<uint32_t> id = UNSET;
+
+        entry(std::string_view text_) : text(text_) {}
+    };
+
+    /* A piece of the arena, followed by its bytes. */
+    struct chunk {
+        chunk* next = nullptr;
+        size_t capacity;
+        size_t used = 0;
+
+        chunk(size_t capacity_) : capacity(capacity_) {}
+
+        char* bytes() {
+            return (char*)(this + 1);
+        }
+    };
+
+    static uint64_t next_instance() {
+        static std::atomic<uint64_t> instances = 1;
+        return instances++;
+    }
+
+    const uint64_t instance = next_instance();
+    // Expires with the interner, so that threads can drop their entries for it.
+    std::shared_ptr<void> alive = std::make_shared<char>();
+
+    map<SIZE, std::string_view, entry> table;
+
+    std::atomic<uint32_t> ids = 0;
+    std::unique_ptr<std::atomic<std::atomic<entry*>*>[]> directory;
+
+    std::atomic<chunk*> chunks = nullptr;
+    std::atomic<size_t> arena_size = 0;
+
+    chunk* new_chunk(size_t capacity) {
+        chunk* c = new (::operator new(sizeof(chunk) + capacity)) chunk(capacity);
+
+        c->next = chunks.load(std::memory_order_relaxed);
+        while (!chunks.compare_exchange_weak(c->next, c, std::memory_order_release, std::memory_order_relaxed)) {}
+
+        arena_size.fetch_add(sizeof(chunk) + capacity, std::memory_order_relaxed);
+        return c;
+    }
+
+    struct local_chunk {
+        std::weak_ptr<void> owner;
+        chunk* current = nullptr;
+    };
+
+    chunk*& local() {
+        // The current chunk of this thread by instance. Instances are never reused; the entries of
+        // destroyed interners are dropped when the thread meets a new one, and the rest when it exits.
+        static thread_local std::unordered_map<uint64_t, local_chunk> mine;
+        static thread_local std::pair<uint64_t, chunk**> last = { 0, nullptr };
+
+        if (last.first == instance) {
+            return *last.second;
+        }
+
+        auto found = mine.find(instance);
+        if (found == mine.end()) {
+            std::erase_if(mine, [](const auto& entry) { return entry.second.owner.expired(); });
+            found = mine.emplace(instance, local_chunk{ alive, nullptr }).first;
+        }
+
+        last = { instance, &found->second.current };
+        return *last.second;
+    }
+
+    std::string_view store(std::string_view s) {
+        chunk*& c = local();
+
+        if (c == nullptr || c->capacity - c->used < s.size()) {
+            // A string larger than a chunk gets a chunk of its own and keeps the current one.
+            if (s.size() > CHUNK / 4) {
+                chunk* own = new_chunk(s.size());
+                std::memcpy(own->bytes(), s.data(), s.size());
+                own->used = s.size();
+                return { own->bytes(), s.size() };
+            }
+            c = new_chunk(CHUNK);
+        }
+
+        char* at = c->bytes() + c->used;
+        std::memcpy(at, s.data(), s.size());
+        c->used += s.size();
+        return { at, s.size() };
+    }
+
+    // Gives back a copy that did not make it into the table, when it is the last one in the chunk.
+    void unstore(std::string_view copy) {
+        chunk* c = local();
+        if (c != nullptr && copy.data() + copy.size() == c->bytes() + c->used) {
+            c->used -= copy.size();
+        }
+    }
+
+    void publish(uint32_t id, entry* e) {
+        std::atomic<std::atomic<entry*>*>& slot = directory[id >> BLOCK_BITS];
+        std::atomic<entry*>* block = slot.load(std::memory_order_acquire);
+
+        if (block == nullptr) {
+            std::atomic<entry*>* fresh = new std::atomic<entry*>[BLOCK]();
+            if (slot.compare_exchange_strong(block, fresh, std::memory_order_acq_rel)) {
+                block = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        block[id & (BLOCK - 1)].store(e, std::memory_order_release);
+    }
+
+    static uint32_t id_of(entry* e) {
+        uint32_t id = e->id.load(std::memory_order_acquire);
+        while (id == UNSET) {
+            e->id.wait(UNSET, std::memory_order_acquire);
+            id = e->id.load(std::memory_order_acquire);
+        }
+        return id;
+    }
+
+    static size_t rehash(size_t hash, auto&& hashfun2) {
+        return hashfun2(hash ^ 0x9e3779b97f4a7c15);
+    }
+
+public:
+
+    struct interned {
+        uint32_t id;
+        std::string_view text;
+    };
+
+    interner() : directory(std::make_unique<std::atomic<std::atomic<entry*>*>[]>(BLOCKS)) {}
+
+    interner(const interner&) = delete;
+    interner& operator=(const interner&) = delete;
+
+    ~interner() {
+        for (size_t b = 0; b < BLOCKS; ++b) {
+            delete[] directory[b].load(std::memory_order_relaxed);
+        }
+        for (chunk* c = chunks.load(std::memory_order_relaxed); c != nullptr; ) {
+            chunk* next = c->next;
+            c->~chunk();
+            ::operator delete(c);
+            c = next;
+        }
+    }
+
+    /* Returns the id and the stored copy of s, adding it if it is new. */
+    interned intern(std::string_view s, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        size_t hash = hashfun1(s);
+
+        for (size_t round = 0; round < maxtries; ++round, hash = rehash(hash, hashfun2)) {
+            entry* e = table.find_hashed(hash, hashfun2, maxtries);
+
+            if (e == nullptr) {
+                std::string_view copy = store(s);
+                auto [ v, inserted ] = table.emplace_hashed(hash, hashfun2, maxtries, copy);
+
+                if (v == nullptr) {
+                    unstore(copy);
+                    throw std::runtime_error("Interner table is full.");
+                }
+
+                if (inserted) {
+                    uint32_t id = ids.fetch_add(1, std::memory_order_relaxed);
+                    if (id == UNSET) {
+                        throw std::runtime_error("Interner ran out of ids.");
+                    }
+                    publish(id, v);
+                    v->id.store(id, std::memory_order_release);
+                    v->id.notify_all();
+                    return { id, v->text };
+                }
+
+                unstore(copy);
+                e = v;
+            }
+
+            if (e->text == s) {
+                return { id_of(e), e->text };
+            }
+        }
+        throw std::runtime_error("Too many hash collisions while interning.");
+    }
+
+    /* The id and stored copy of s, if it was interned. */
+    std::optional<interned> find(std::string_view s, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        size_t hash = hashfun1(s);
+
+        for (size_t round = 0; round < maxtries; ++round, hash = rehash(hash, hashfun2)) {
+            entry* e = table.find_hashed(hash, hashfun2, maxtries);
+
+            if (e == nullptr) {
+                return std::nullopt;
+            } else if (e->text == s) {
+                return interned{ id_of(e), e->text };
+            }
+        }
+        return std::nullopt;
+    }
+
+    /* The string with an id returned by intern() or find(). */
+    std::string_view lookup(uint32_t id) const {
+        return directory[id >> BLOCK_BITS].load(std::memory_order_acquire)[id & (BLOCK - 1)].load(std::memory_order_acquire)->text;
+    }
+
+    /* Number of ids handed out so far; ids are dense, from 0. */
+    size_t size() const {
+        return ids.load(std::memory_order_acquire);
+    }
+
+    /* Bytes reserved for string copies. */
+    size_t arena_bytes() const {
+        return arena_size.load(std::memory_order_relaxed);
+    }
+};
+
+}
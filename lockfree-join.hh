@@ -0,0 +1,166 @@
+#pragma once
+
+/*
+ * A parallel hash join on top of the lockfree map.
+ *
+ *   lockfree::hash_join<1 << 20, uint64_t, dimension_row> join;
+ *   join.build(dim_keys.data(), dim_rows.data(), dim_rows.size(), hash1, hash2, pool);
+ *
+ *   auto out = join.probe(event_keys.data(), events.size(), hash1, hash2, pool);
+ *   for (const auto& part : out) {
+ *       for (auto [ probe, build ] : part) {
+ *           use(events[probe], join.row(build));
+ *       }
+ *   }
+ *
+ * build() copies the build side and inserts it through the bulk-load path. The map holds one
+ * entry per distinct hash with the head of a chain of build rows, so duplicate keys are
+ * allowed: a new row is pushed onto the chain with a compare-and-swap. Keys are compared when
+ * the chain is walked, so rows of different keys with the same hash are told apart.
+ *
+ * probe() cuts the probe keys into morsels for the pool's workers and looks every batch of
+ * keys up with map::find_many(). Every task appends to its own output buffer, so workers never
+ * share one, and probe() returns the buffers without concatenating them. In join_mode::inner
+ * every matching (probe, build) pair is emitted, in join_mode::semi every probe row with at
+ * least one match once, and in join_mode::anti every probe row without a match, with
+ * build == NO_MATCH.
+ *
+ * build() must not run at the same time as probe().
+ */
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "lockfree-map.hh"
+
+namespace lockfree {
+
+enum class join_mode { inner, semi, anti };
+
+template <size_t SIZE, typename KEY, typename ROW>
+class hash_join {
+
+    static constexpr size_t MORSEL = 16384;
+    static constexpr size_t BATCH = 64;
+
+    /* The build rows of one hash, as index + 1 of the first one; next holds the rest of the chain. */
+    struct chain {
+        std::atomic<size_t> head;
+
+        chain(size_t first) : head(first + 1) {}
+    };
+
+    map<SIZE, KEY, chain> table;
+
+    std::vector<KEY> keys;
+    std::vector<ROW> rows;
+    std::vector<size_t> next;
+
+public:
+
+    static constexpr size_t NO_MATCH = SIZE_MAX;
+
+    struct joined {
+        size_t probe;
+        size_t build;
+    };
+
+    /* Adds n build rows; rows with the same key are all kept. */
+    typename map<SIZE, KEY, chain>::bulk_stats build(const KEY* build_keys, const ROW* build_rows, size_t n,
+                                                     auto&& hashfun1, auto&& hashfun2, auto&& pool, size_t maxtries = 32) {
+        size_t first = keys.size();
+        keys.insert(keys.end(), build_keys, build_keys + n);
+        rows.insert(rows.end(), build_rows, build_rows + n);
+        next.resize(first + n, 0);
+
+        return table.bulk_emplace(n,
+                                  [&](size_t i) { return hashfun1(keys[first + i]); },
+                                  [&](size_t i) { return first + i; },
+                                  [&](chain& c, size_t i) {
+                                      size_t head = c.head.load(std::memory_order_relaxed);
+                                      do {
+                                          next[first + i] = head;
+                                      } while (!c.head.compare_exchange_weak(head, first + i + 1, std::memory_order_release,
+                                                                             std::memory_order_relaxed));
+                                  },
+                                  hashfun2, pool, maxtries);
+    }
+
+    typename map<SIZE, KEY, chain>::bulk_stats build(const KEY* build_keys, const ROW* build_rows, size_t n,
+                                                     auto&& hashfun1, auto&& hashfun2) {
+        return build(build_keys, build_rows, n, hashfun1, hashfun2, default_pool());
+    }
+
+    /* Joins n probe keys against the build side; returns one buffer of results per task. */
+    std::vector<std::vector<joined>> probe(const KEY* probe_keys, size_t n, auto&& hashfun1, auto&& hashfun2, auto&& pool,
+                                           join_mode mode = join_mode::inner, size_t maxtries = 32) {
+        size_t morsels = (n + MORSEL - 1) / MORSEL;
+        std::vector<std::vector<joined>> out(morsels);
+
+        pool.parallel_for(morsels, [&](size_t m) {
+            std::array<size_t, BATCH> hashes;
+            std::array<chain*, BATCH> found;
+            std::vector<joined>& buf = out[m];
+
+            size_t lo = m * MORSEL;
+            size_t hi = std::min(n, lo + MORSEL);
+
+            for (size_t first = lo; first < hi; first += BATCH) {
+                size_t count = std::min(BATCH, hi - first);
+
+                for (size_t i = 0; i < count; ++i) {
+                    hashes[i] = hashfun1(probe_keys[first + i]);
+                }
+                table.find_many(hashes.data(), count, found.data(), hashfun2, maxtries);
+
+                for (size_t i = 0; i < count; ++i) {
+                    const KEY& key = probe_keys[first + i];
+                    bool matched = false;
+
+                    for (size_t b = found[i] ? found[i]->head.load(std::memory_order_acquire) : 0; b != 0; b = next[b - 1]) {
+                        if (!(keys[b - 1] == key)) {
+                            continue;
+                        }
+                        matched = true;
+                        if (mode == join_mode::anti) {
+                            break;
+                        }
+                        buf.push_back({ first + i, b - 1 });
+                        if (mode == join_mode::semi) {
+                            break;
+                        }
+                    }
+
+                    if (mode == join_mode::anti && !matched) {
+                        buf.push_back({ first + i, NO_MATCH });
+                    }
+                }
+            }
+        });
+
+        return out;
+    }
+
+    std::vector<std::vector<joined>> probe(const KEY* probe_keys, size_t n, auto&& hashfun1, auto&& hashfun2) {
+        return probe(probe_keys, n, hashfun1, hashfun2, default_pool());
+    }
+
+    /* The build row with the given index, as returned by probe(). */
+    const ROW& row(size_t build) const {
+        return rows[build];
+    }
+
+    const KEY& key(size_t build) const {
+        return keys[build];
+    }
+
+    /* Number of build rows. */
+    size_t size() const {
+        return rows.size();
+    }
+};
+
+}
@@ -2,7 +2,8 @@
 
 /* 
  * This is an atomic lock-free hash map implementation.
- * Entries from the map CANNOT be deleted.
+ * Entries can be removed with erase_hashed() once enable_erase() was called, which leaves a ghost
+ * in the slot that any later insert can take; their memory is only given back by reclaim().
  * A hash map size must be provided statically.
  * Two hash functions are assumed - one for hashing the key, 
  * and a second-order hash function for hashing hash values in case of hash collisions.
@@ -11,83 +12,401 @@
  * Hash collisions are not checked; you must check yourself for the unlikely event that two keys have the same hash.
  */
 
+#include <algorithm>
 #include <atomic>
 #include <array>
+#include <bit>
 #include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "lockfree-executor.hh"
 
 namespace lockfree {
 
-namespace {
+namespace detail {
 
 template <typename KEY, typename VALUE>
 struct Element_ {
     size_t hash;
     VALUE val;
 
-    Element_(const KEY& key, size_t hash_) : hash(hash_), val(key) {}
+    template <typename... Args>
+    Element_(size_t hash_, Args&&... args) : hash(hash_), val(std::forward<Args>(args)...) {}
 };
 
 }
 
 template <size_t SIZE, typename KEY, typename VALUE>
 struct map {
+private:
+
+    struct arena;
+
+public:
 
     ~map() {
-        for (size_t i = 0; i < SIZE; ++i) {
-            Element* elt = hashmap[i].load(std::memory_order_relaxed);
+        std::vector<Element*> elements;
 
-            if (elt != nullptr) {
-                delete elt;
+        for (size_t w = 0; w < WORDS; ++w) {
+            uint64_t word = occupied[w].load(std::memory_order_relaxed);
+
+            while (word != 0) {
+                Element* elt = hashmap[w * 64 + std::countr_zero(word)].load(std::memory_order_relaxed);
+                word &= word - 1;
+
+                if (is_live(elt)) {
+                    elements.push_back(elt);
+                }
             }
         }
+
+        reclaim();
+        destroy(elements);
+        take_erased();
+
+        for (arena* a = arenas.load(std::memory_order_relaxed); a != nullptr; ) {
+            arena* next = a->next;
+            delete a;
+            a = next;
+        }
     }
 
     VALUE* get(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return emplace_hashed(hashfun1(key), hashfun2, maxtries, key).first;
+    }
 
+    /*
+     * Like get(), then calls fn(value) and marks the region of the entry dirty after fn returns.
+     * With dirty tracking, use this for writes that can race with a checkpoint: get() marks the
+     * region before the caller writes, so such a write can miss both the checkpoint and the next
+     * delta. A write made here is in one of them.
+     */
+    VALUE* update(const KEY& key, auto&& hashfun1, auto&& hashfun2, auto&& fn, size_t maxtries = 32) {
         size_t hash = hashfun1(key);
+        Element* elt = insert_hashed(hash, hashfun2, maxtries,
+                                     [&]() { return new Element(hash, key); },
+                                     [](Element* e) { delete e; }).first;
+        if (elt == nullptr) {
+            return nullptr;
+        }
+        fn(elt->val);
+
+        if (dirty) {
+            size_t hash2 = hash;
+            for (size_t tries = 0; tries < maxtries; ++tries) {
+                if (hashmap[hash2 % SIZE].load(std::memory_order_acquire) == elt) {
+                    mark_written(hash2 % SIZE);
+                    break;
+                }
+                hash2 = hashfun2(hash2);
+            }
+        }
+        return &elt->val;
+    }
+
+    /* Like get(), but never inserts: returns a null pointer when the key is not in the map. */
+    VALUE* find(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return find_hashed(hashfun1(key), hashfun2, maxtries);
+    }
+
+    VALUE* find_hashed(size_t hash, auto&& hashfun2, size_t maxtries = 32) {
         size_t hash2 = hash;
 
-        size_t tries = 0;
-        size_t bucket;
-        while (tries < maxtries) {
-            bucket = hash2 % SIZE;
-            Element* elt = hashmap[bucket].load(std::memory_order_relaxed);
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            Element* elt = hashmap[hash2 % SIZE].load(std::memory_order_acquire);
 
             if (elt == nullptr) {
-                Element* newelt = new Element(key, hash);
+                return nullptr;
 
-                if (hashmap[bucket].compare_exchange_weak(elt, newelt, std::memory_order_release, std::memory_order_relaxed)) {
-                    return &newelt->val;
+            } else if (is_live(elt) && elt->hash == hash) {
+                return &elt->val;
+            }
+            hash2 = hashfun2(hash2);
+        }
+        return nullptr;
+    }
 
-                } else if (elt->hash == hash) {
-                    delete newelt;
-                    return &elt->val;
+    /*
+     * Hints for batched lookups: prefetch() asks for the first slot of hash, and prefetch_value()
+     * for the element in that slot once the slot is expected to be in cache. Issuing them for a
+     * whole batch of hashes before probing overlaps the cache misses of the batch.
+     */
+    void prefetch(size_t hash) const {
+        __builtin_prefetch(&hashmap[hash % SIZE]);
+    }
+
+    void prefetch_value(size_t hash) const {
+        Element* elt = hashmap[hash % SIZE].load(std::memory_order_relaxed);
+        if (is_live(elt)) {
+            __builtin_prefetch(elt);
+        }
+    }
+
+    /* find_hashed() for a batch of hashes, with the prefetches for the whole batch issued first; out[i] is the value of hashes[i]. */
+    void find_many(const size_t* hashes, size_t n, VALUE** out, auto&& hashfun2, size_t maxtries = 32) {
+        for (size_t i = 0; i < n; ++i) {
+            prefetch(hashes[i]);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            prefetch_value(hashes[i]);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = find_hashed(hashes[i], hashfun2, maxtries);
+        }
+    }
 
-                } else if (elt->hash != 0) {
-                    delete newelt;
-                    hash2 = hashfun2(hash2);
+    /*
+     * Like get(), but for an already computed hash, and with the value constructed from args.
+     * Returns the value (nullptr when no bucket was found) and whether this call inserted it.
+     */
+    template <typename... Args>
+    std::pair<VALUE*, bool> emplace_hashed(size_t hash, auto&& hashfun2, size_t maxtries, Args&&... args) {
+        auto [ elt, inserted ] = insert_hashed(hash, hashfun2, maxtries,
+                                               [&]() { return new Element(hash, std::forward<Args>(args)...); },
+                                               [](Element* e) { delete e; });
+        return { elt ? &elt->val : nullptr, inserted };
+    }
+
+    struct bulk_stats {
+        size_t inserted = 0;
+        size_t found = 0;
+        size_t failed = 0;
+    };
+
+    /*
+     * Same result as calling get() for every key, but hashes in parallel, radix-partitions the keys
+     * by the region of the table their first bucket falls into, and lets each worker fill one region.
+     * New elements are allocated from one arena block per region instead of one by one.
+     */
+    template <typename RANGE>
+    bulk_stats bulk_insert(const RANGE& keys, auto&& hashfun1, auto&& hashfun2, auto&& pool, size_t maxtries = 32) {
+        auto first = std::begin(keys);
+
+        return bulk_emplace(std::size(keys),
+                            [&](size_t i) { return hashfun1(first[i]); },
+                            [&](size_t i) -> decltype(auto) { return first[i]; },
+                            [](VALUE&, size_t) {},
+                            hashfun2, pool, maxtries);
+    }
+
+    template <typename RANGE>
+    bulk_stats bulk_insert(const RANGE& keys, auto&& hashfun1, auto&& hashfun2) {
+        return bulk_insert(keys, hashfun1, hashfun2, default_pool());
+    }
+
+    /*
+     * The bulk-load path behind bulk_insert(), for n entries given by index, that persistence and
+     * replication use to load entries that already carry their hash and value.
+     * Entry i has the hash hash_of(i); if it is new it gets the value VALUE(arg_of(i)),
+     * otherwise on_found(value, i) is called on the value already in the map.
+     */
+    bulk_stats bulk_emplace(size_t n, auto&& hash_of, auto&& arg_of, auto&& on_found, auto&& hashfun2, auto&& pool, size_t maxtries = 32) {
+        size_t regions = std::min<size_t>(std::bit_ceil(pool.concurrency() * 4), WORDS);
+        size_t region_size = (SIZE + regions - 1) / regions;
+        size_t chunks = std::min<size_t>(pool.concurrency() * 4, std::max<size_t>(n / 4096, 1));
+        size_t chunk_size = (n + chunks - 1) / chunks;
+
+        // Pass 1: hash and count per (chunk, region).
+        std::vector<size_t> hashes(n);
+        std::vector<size_t> counts(chunks * regions);
+
+        pool.parallel_for(chunks, [&](size_t c) {
+            size_t* count = &counts[c * regions];
+            for (size_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); ++i) {
+                hashes[i] = hash_of(i);
+                ++count[(hashes[i] % SIZE) / region_size];
+            }
+        });
+
+        // Turn the counts into scatter offsets, region-major so that each region is contiguous.
+        std::vector<size_t> region_start(regions + 1);
+        size_t offset = 0;
+        for (size_t r = 0; r < regions; ++r) {
+            region_start[r] = offset;
+            for (size_t c = 0; c < chunks; ++c) {
+                size_t count = counts[c * regions + r];
+                counts[c * regions + r] = offset;
+                offset += count;
+            }
+        }
+        region_start[regions] = offset;
+
+        // Pass 2: scatter (hash, key index) pairs.
+        std::vector<std::pair<size_t, size_t>> sorted(n);
+
+        pool.parallel_for(chunks, [&](size_t c) {
+            size_t* next = &counts[c * regions];
+            for (size_t i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size); ++i) {
+                sorted[next[(hashes[i] % SIZE) / region_size]++] = { hashes[i], i };
+            }
+        });
+
+        // Pass 3: every region is inserted by one worker, in slot order.
+        std::vector<bulk_stats> stats(regions);
+
+        pool.parallel_for(regions, [&](size_t r) {
+            size_t lo = region_start[r];
+            size_t hi = region_start[r + 1];
+            if (lo == hi) {
+                return;
+            }
+
+            arena* a = new arena(hi - lo);
+
+            for (size_t i = lo; i < hi; ++i) {
+                if (i + 8 < hi) {
+                    __builtin_prefetch(&hashmap[sorted[i + 8].first % SIZE]);
                 }
-                
-            } else if (elt->hash == hash) {
-                return &elt->val;
 
-            } else if (elt->hash != 0) {
-                hash2 = hashfun2(hash2);
+                auto [ elt, inserted ] = insert_hashed(sorted[i].first, hashfun2, maxtries,
+                                                       [&]() { return a->emplace(sorted[i].first, arg_of(sorted[i].second)); },
+                                                       [&](Element* e) { a->give_back(e); });
+                if (elt == nullptr) {
+                    ++stats[r].failed;
+                } else if (inserted) {
+                    ++stats[r].inserted;
+                } else {
+                    on_found(elt->val, sorted[i].second);
+                    ++stats[r].found;
+                }
             }
-            ++tries;
+
+            retire(a);
+        });
+
+        bulk_stats ret;
+        for (const auto& s : stats) {
+            ret.inserted += s.inserted;
+            ret.found += s.found;
+            ret.failed += s.failed;
         }
+        return ret;
+    }
 
-        return nullptr;
+    /*
+     * Merges the entries of other maps (of the same type, filled with the same hash functions) into this one.
+     * A key found in this map gets combiner(dst_value, src_value); a missing key is inserted with a
+     * default-constructed value that is combined with the source value before it is published
+     * (or a copy of the source value, if VALUE is not default-constructible).
+     * Both tables are scanned in slot order, one region per task, and an entry is first looked
+     * for in the same slot as in the source, which is where it is when both maps saw the same
+     * insertion history for that region.
+     * The combiner can run concurrently for the same destination value when several sources share a key.
+     */
+    bulk_stats merge_from(const std::vector<map<SIZE, KEY, VALUE>*>& srcs, auto&& combiner, auto&& hashfun2, auto&& pool, size_t maxtries = 32) {
+        std::vector<range> parts = partition(pool.concurrency() * 4);
+        std::vector<bulk_stats> stats(parts.size());
+
+        pool.parallel_for(parts.size(), [&](size_t p) {
+            arena* block = nullptr;
+
+            for (map<SIZE, KEY, VALUE>* src : srcs) {
+                for (iterator i(*src, parts[p].first, parts[p].last); i.bucket < i.limit; ++i) {
+                    Element* same = hashmap[i.bucket].load(std::memory_order_acquire);
+
+                    if (is_live(same) && same->hash == i.hash()) {
+                        combiner(same->val, *i);
+                        mark_dirty(i.bucket);
+                        ++stats[p].found;
+                        continue;
+                    }
+
+                    block = ensure_room(block);
+
+                    auto [ elt, inserted ] = insert_hashed(i.hash(), hashfun2, maxtries,
+                                                           [&]() {
+                                                               if constexpr (std::is_default_constructible_v<VALUE>) {
+                                                                   Element* e = block->emplace(i.hash());
+                                                                   combiner(e->val, *i);
+                                                                   return e;
+                                                               } else {
+                                                                   return block->emplace(i.hash(), *i);
+                                                               }
+                                                           },
+                                                           [&](Element* e) { block->give_back(e); });
+                    if (elt == nullptr) {
+                        ++stats[p].failed;
+                    } else if (inserted) {
+                        ++stats[p].inserted;
+                    } else {
+                        combiner(elt->val, *i);
+                        ++stats[p].found;
+                    }
+                }
+            }
+
+            retire(block);
+        });
+
+        bulk_stats ret;
+        for (const auto& s : stats) {
+            ret.inserted += s.inserted;
+            ret.found += s.found;
+            ret.failed += s.failed;
+        }
+        return ret;
+    }
+
+    /*
+     * Inserts from a single thread while no other thread can see the map: slots are written
+     * with plain stores and elements are allocated in growing blocks.
+     * publish() (or the builder going out of scope) makes the contents visible to threads
+     * that are handed the map afterwards.
+     */
+    struct builder {
+        map<SIZE, KEY, VALUE>& self;
+        arena* block = nullptr;
+
+        builder(map<SIZE, KEY, VALUE>& s) : self(s) {}
+        builder(const builder&) = delete;
+        builder& operator=(const builder&) = delete;
+
+        ~builder() {
+            publish();
+        }
+
+        VALUE* get(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+            return emplace_hashed(hashfun1(key), hashfun2, maxtries, key).first;
+        }
+
+        template <typename... Args>
+        std::pair<VALUE*, bool> emplace_hashed(size_t hash, auto&& hashfun2, size_t maxtries, Args&&... args) {
+            block = self.ensure_room(block);
+
+            auto [ elt, inserted ] = self.template insert_hashed<false>(hash, hashfun2, maxtries,
+                                                                        [&]() { return block->emplace(hash, std::forward<Args>(args)...); },
+                                                                        [&](Element* e) { block->give_back(e); });
+            return { elt ? &elt->val : nullptr, inserted };
+        }
+
+        void publish() {
+            self.retire(block);
+            block = nullptr;
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+    };
+
+    builder build_unsynchronized() {
+        return builder(*this);
     }
 
     struct iterator {
         using container_type = map<SIZE, KEY, VALUE>;
         size_t bucket;
+        size_t limit;
         typename container_type::Element* value;
         container_type& self;
 
-        iterator(map<SIZE, KEY, VALUE>& s, size_t b) : bucket(b), value(nullptr), self(s) {
+        iterator(map<SIZE, KEY, VALUE>& s, size_t b, size_t l = SIZE) : bucket(b), limit(l), value(nullptr), self(s) {
             increment();
         }
 
@@ -95,8 +414,12 @@ struct map {
             return value->val;
         }
 
+        size_t hash() const {
+            return value->hash;
+        }
+
         iterator& operator++() {
-            if (bucket < SIZE) {
+            if (bucket < limit) {
                 ++bucket;
                 increment();
             }
@@ -108,14 +431,36 @@ struct map {
         }
 
     private:
+        // Skips empty slots a whole bitmap word (64 slots) at a time, and prefetches
+        // the next element in the same word so that it is in cache by the time we get to it.
         void increment() {
-            while (bucket < SIZE) {
-                value = self.hashmap[bucket].load(std::memory_order_relaxed);
-                if (value != nullptr) {
+            while (bucket < limit) {
+                uint64_t word = self.occupied[bucket / 64].load(std::memory_order_acquire) >> (bucket % 64);
+
+                if (word == 0) {
+                    bucket = (bucket / 64 + 1) * 64;
+                    continue;
+                }
+
+                size_t base = bucket;
+                bucket = base + std::countr_zero(word);
+                if (bucket >= limit) {
                     break;
                 }
-                ++bucket;
+                value = self.hashmap[bucket].load(std::memory_order_acquire);
+
+                if (!is_live(value)) {
+                    ++bucket;
+                    continue;
+                }
+
+                word &= word - 1;
+                if (word != 0) {
+                    __builtin_prefetch(self.hashmap[base + std::countr_zero(word)].load(std::memory_order_relaxed));
+                }
+                return;
             }
+            bucket = limit;
         }
     };
 
@@ -127,12 +472,653 @@ struct map {
         return iterator(*this, SIZE);
     }
 
+    /* A contiguous run of slots [first, last), iterable on its own. */
+    struct range {
+        map<SIZE, KEY, VALUE>& self;
+        size_t first;
+        size_t last;
+
+        iterator begin() const {
+            return iterator(self, first, last);
+        }
+
+        iterator end() const {
+            return iterator(self, last, last);
+        }
+    };
+
+    /* Splits the slots into at most n disjoint ranges of roughly equal size, in slot order. */
+    std::vector<range> partition(size_t n) {
+        // Keep boundaries on bitmap words so that no two ranges share a word.
+        size_t words = std::max<size_t>((WORDS + std::max<size_t>(n, 1) - 1) / std::max<size_t>(n, 1), 1);
+
+        std::vector<range> ret;
+        for (size_t first = 0; first < SIZE; first += words * 64) {
+            ret.push_back(range{*this, first, std::min(first + words * 64, SIZE)});
+        }
+        return ret;
+    }
+
+    /* Calls fn(value) for every value, with the slots split across the executor's workers. */
+    void for_each(auto&& pool, auto&& fn) {
+        std::vector<range> parts = partition(pool.concurrency() * 4);
+
+        pool.parallel_for(parts.size(), [&](size_t i) {
+            for (VALUE& v : parts[i]) {
+                fn(v);
+            }
+        });
+    }
+
+    void for_each(auto&& fn) {
+        for_each(default_pool(), fn);
+    }
+
+    /* Folds transform(value) into init with reduce; reduce must be associative and commutative. */
+    template <typename T>
+    T transform_reduce(auto&& pool, T init, auto&& reduce, auto&& transform) {
+        std::vector<range> parts = partition(pool.concurrency() * 4);
+        std::vector<std::optional<T>> partial(parts.size());
+
+        pool.parallel_for(parts.size(), [&](size_t i) {
+            std::optional<T> acc;
+            for (VALUE& v : parts[i]) {
+                acc = acc ? reduce(std::move(*acc), transform(v)) : T(transform(v));
+            }
+            partial[i] = std::move(acc);
+        });
+
+        for (auto& p : partial) {
+            if (p) {
+                init = reduce(std::move(init), std::move(*p));
+            }
+        }
+        return init;
+    }
+
+    template <typename T>
+    T transform_reduce(T init, auto&& reduce, auto&& transform) {
+        return transform_reduce(default_pool(), std::move(init), reduce, transform);
+    }
+
+    /*
+     * The k values with the highest score(value), highest first; ties are broken arbitrarily.
+     * Every part of the slots keeps a min-heap of its best k, which a value only enters when it
+     * beats the smallest one, and the parts' heaps are merged at the end.
+     */
+    std::vector<VALUE*> top_k(auto&& pool, size_t k, auto&& score) {
+        using S = std::decay_t<decltype(score(std::declval<VALUE&>()))>;
+        using scored = std::pair<S, VALUE*>;
+        auto higher = [](const scored& a, const scored& b) { return b.first < a.first; };
+
+        if (k == 0) {
+            return {};
+        }
+
+        std::vector<range> parts = partition(pool.concurrency() * 4);
+        std::vector<std::vector<scored>> heaps(parts.size());
+
+        pool.parallel_for(parts.size(), [&](size_t i) {
+            std::vector<scored>& heap = heaps[i];
+            for (VALUE& v : parts[i]) {
+                S s = score(v);
+                if (heap.size() < k) {
+                    heap.emplace_back(std::move(s), &v);
+                    std::push_heap(heap.begin(), heap.end(), higher);
+                } else if (heap.front().first < s) {
+                    std::pop_heap(heap.begin(), heap.end(), higher);
+                    heap.back() = scored(std::move(s), &v);
+                    std::push_heap(heap.begin(), heap.end(), higher);
+                }
+            }
+        });
+
+        std::vector<scored> all;
+        for (auto& heap : heaps) {
+            all.insert(all.end(), std::make_move_iterator(heap.begin()), std::make_move_iterator(heap.end()));
+        }
+        size_t n = std::min(k, all.size());
+        std::partial_sort(all.begin(), all.begin() + n, all.end(), higher);
+
+        std::vector<VALUE*> ret(n);
+        for (size_t i = 0; i < n; ++i) {
+            ret[i] = all[i].second;
+        }
+        return ret;
+    }
+
+    std::vector<VALUE*> top_k(size_t k, auto&& score) {
+        return top_k(default_pool(), k, score);
+    }
+
+    /*
+     * Dirty tracking, for incremental checkpoints: once enabled, every get() (and every other
+     * insert or lookup-for-update) marks the region of region_slots slots that holds the entry.
+     * Enable it before the map is shared with other threads. The mark is made before the caller
+     * writes through the returned pointer: a write that races with take_dirty() is not tracked,
+     * and neither are writes through pointers obtained from find() or from an earlier get().
+     * Use update() for those. The hashes of erased entries are kept as well, until take_erased().
+     */
+    void enable_dirty_tracking(size_t region_slots = 512) {
+        dirty_shift = std::countr_zero(std::bit_ceil(std::max<size_t>(region_slots, 64)));
+        size_t regions = ((SIZE - 1) >> dirty_shift) + 1;
+        dirty = std::make_unique<std::atomic<uint64_t>[]>((regions + 63) / 64);
+    }
+
+    /*
+     * Calls fn(ctx, hash, value) for every new entry, from the thread that inserted it, right
+     * after it is published (see change_feed in lockfree-feed.hh). Set it before the map is
+     * shared with other threads; a null fn turns it off.
+     */
+    void on_insert(void (*fn)(void* ctx, size_t hash, VALUE* value), void* ctx) {
+        insert_hook = fn;
+        insert_hook_ctx = ctx;
+    }
+
+    /*
+     * Erase support: call it before the map is shared with other threads. Without it every
+     * insert publishes its element with a single compare-and-swap from an empty slot, and
+     * erase_hashed() throws. With it, concurrent inserts reserve a slot and publish in a second
+     * step, since a ghost can be taken by any hash, and an insert may wait for a racing insert
+     * of the same hash to finish.
+     */
+    void enable_erase() {
+        erasable = true;
+    }
+
+    bool erase_enabled() const {
+        return erasable;
+    }
+
+    /*
+     * Removes the entry with this hash; returns whether it was there. on_erase(value) is called
+     * with the removed value, which stays readable until reclaim(). Needs enable_erase().
+     * The slot keeps a ghost, which lookups probe past and which the next insert whose chain
+     * goes through the slot can take, whatever its hash.
+     */
+    bool erase_hashed(size_t hash, auto&& hashfun2, size_t maxtries, auto&& on_erase) {
+        if (!erasable) {
+            throw std::runtime_error("Erasing from a map without enable_erase().");
+        }
+        size_t hash2 = hash;
+
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            size_t bucket = hash2 % SIZE;
+            Element* elt = hashmap[bucket].load(std::memory_order_acquire);
+
+            if (elt == nullptr) {
+                return false;
+
+            } else if (is_live(elt) && elt->hash == hash) {
+                // From now on inserts check their chain again before publishing (see settle()).
+                if (!has_ghosts.load(std::memory_order_relaxed)) {
+                    has_ghosts.store(true, std::memory_order_seq_cst);
+                }
+                if (!hashmap[bucket].compare_exchange_strong(elt, ghost_of(hash), std::memory_order_seq_cst)) {
+                    // Erased or replaced meanwhile: look at the slot again.
+                    continue;
+                }
+                mark_dirty(bucket);
+                if (dirty) {
+                    // The ghost can be taken by another key before the next checkpoint, so the hash is kept aside.
+                    tombstone* t = new tombstone{ hash, tombstones.load(std::memory_order_relaxed) };
+                    while (!tombstones.compare_exchange_weak(t->next, t, std::memory_order_release, std::memory_order_relaxed)) {}
+                }
+                on_erase(elt->val);
+                retire_element(elt);
+                return true;
+            }
+            hash2 = hashfun2(hash2);
+        }
+        return false;
+    }
+
+    bool erase_hashed(size_t hash, auto&& hashfun2, size_t maxtries = 32) {
+        return erase_hashed(hash, hashfun2, maxtries, [](VALUE&) {});
+    }
+
+    bool erase(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return erase_hashed(hashfun1(key), hashfun2, maxtries);
+    }
+
+    /*
+     * Frees the elements removed by erase_hashed() so far. Only call it when no thread can still
+     * be using a pointer to an erased value, e.g. between batches of work.
+     */
+    size_t reclaim() {
+        std::vector<Element*> elements;
+        for (retired* r = erased.exchange(nullptr, std::memory_order_acquire); r != nullptr; ) {
+            retired* next = r->next;
+            elements.push_back(r->elt);
+            delete r;
+            r = next;
+        }
+        destroy(elements);
+        return elements.size();
+    }
+
+    /* Clears the hashes erased since dirty tracking was enabled or since the last call, and returns them. */
+    std::vector<size_t> take_erased() {
+        std::vector<size_t> ret;
+        for (tombstone* t = tombstones.exchange(nullptr, std::memory_order_acquire); t != nullptr; ) {
+            tombstone* next = t->next;
+            ret.push_back(t->hash);
+            delete t;
+            t = next;
+        }
+        return ret;
+    }
+
+    /* Calls fn(slot) for every slot of [first, last) that lookups probe past without an entry: ghosts and inserts under way. */
+    void for_each_ghost(size_t first, size_t last, auto&& fn) const {
+        for (size_t w = first / 64; w * 64 < last; ++w) {
+            uint64_t word = occupied[w].load(std::memory_order_acquire);
+
+            while (word != 0) {
+                size_t bucket = w * 64 + std::countr_zero(word);
+                word &= word - 1;
+
+                Element* elt = hashmap[bucket].load(std::memory_order_acquire);
+                if (bucket >= first && bucket < last && elt != nullptr && !is_live(elt)) {
+                    fn(bucket);
+                }
+            }
+        }
+    }
+
+    /* Clears the dirty regions and returns them as slot ranges; adjacent regions are merged into one range. */
+    std::vector<range> take_dirty() {
+        std::vector<range> ret;
+        if (!dirty) {
+            return ret;
+        }
+
+        size_t regions = ((SIZE - 1) >> dirty_shift) + 1;
+        for (size_t w = 0; w < (regions + 63) / 64; ++w) {
+            uint64_t word = dirty[w].exchange(0, std::memory_order_acquire);
+
+            while (word != 0) {
+                size_t first = (w * 64 + std::countr_zero(word)) << dirty_shift;
+                size_t last = std::min(first + (size_t(1) << dirty_shift), SIZE);
+                word &= word - 1;
+
+                if (!ret.empty() && ret.back().last == first) {
+                    ret.back().last = last;
+                } else {
+                    ret.push_back(range{*this, first, last});
+                }
+            }
+        }
+        return ret;
+    }
+
 private:
 
-    using Element = Element_<KEY, VALUE>;
+    using Element = detail::Element_<KEY, VALUE>;
+
+    static constexpr size_t WORDS = (SIZE + 63) / 64;
+
+    /* A block of elements for bulk inserts; freed together with the map. */
+    struct arena {
+        arena* next = nullptr;
+        Element* first;
+        size_t capacity;
+        size_t used = 0;
+
+        arena(size_t n) : first(std::allocator<Element>().allocate(n)), capacity(n) {}
+
+        ~arena() {
+            std::allocator<Element>().deallocate(first, capacity);
+        }
+
+        void* next_free() {
+            return first + used;
+        }
+
+        /* Constructs the next element; give_back() undoes the last one. */
+        template <typename... Args>
+        Element* emplace(Args&&... args) {
+            Element* e = new (next_free()) Element(std::forward<Args>(args)...);
+            ++used;
+            return e;
+        }
+
+        void give_back(Element* e) {
+            e->~Element();
+            --used;
+        }
+
+        bool owns(Element* e) const {
+            return !std::less<Element*>()(e, first) && std::less<Element*>()(e, first + capacity);
+        }
+    };
+
+    void adopt(arena* a) {
+        a->next = arenas.load(std::memory_order_relaxed);
+        while (!arenas.compare_exchange_weak(a->next, a, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    // Returns a block with room for one more element; a full block is handed over to the map
+    // and replaced by one twice its size.
+    arena* ensure_room(arena* block) {
+        if (block != nullptr && block->used < block->capacity) {
+            return block;
+        }
+
+        size_t capacity = (block == nullptr ? 1024 : std::min<size_t>(block->capacity * 2, 1 << 20));
+        if (block != nullptr) {
+            adopt(block);
+        }
+        return new arena(capacity);
+    }
+
+    // Hands a block over to the map when it is done being filled.
+    void retire(arena* block) {
+        if (block == nullptr) {
+            return;
+        }
+        if (block->used == 0) {
+            delete block;
+        } else {
+            adopt(block);
+        }
+    }
+
+    /*
+     * The probe loop shared by all inserts.
+     * The whole chain is searched for the hash first; a new entry then goes into the first free
+     * slot of the chain, empty or a ghost. make() is called at most once, when there is a free
+     * slot; if the element it made is not the one that ends up in the table, it is handed back to
+     * release(), or retired when other threads may have seen it (see reclaim()).
+     * With CONCURRENT = false slots are filled with plain stores (see build_unsynchronized()).
+     *
+     * Without enable_erase() there are no ghosts, the first free slot is the end of the chain for
+     * every insert of a hash, and the element is published with one compare-and-swap.
+     * With it, concurrent inserts first put a reservation in the slot and then publish the element.
+     * Before the first erase the first free slot is still the end of the chain; after it, two
+     * inserts of the same hash can pick different ghosts, so the chain is checked again with
+     * settle() before publishing.
+     */
+    template <bool CONCURRENT = true>
+    std::pair<Element*, bool> insert_hashed(size_t hash, auto&& hashfun2, size_t maxtries, auto&& make, auto&& release) {
+        Element* newelt = nullptr;
+        bool shown = false;
+
+        auto drop = [&]() {
+            if (newelt == nullptr) {
+                return;
+            } else if (shown) {
+                retire_element(newelt);
+            } else {
+                release(newelt);
+            }
+        };
+
+        while (true) {
+            size_t hash2 = hash;
+            size_t free = SIZE;
+            Element* free_was = nullptr;
+            bool again = false;
+
+            for (size_t tries = 0; tries < maxtries; ++tries) {
+                size_t bucket = hash2 % SIZE;
+                Element* elt = hashmap[bucket].load(std::memory_order_acquire);
+
+                if (elt == nullptr) {
+                    if (free == SIZE) {
+                        free = bucket;
+                        free_was = nullptr;
+                    }
+                    break;
+
+                } else if (is_ghost(elt)) {
+                    if (free == SIZE) {
+                        free = bucket;
+                        free_was = elt;
+                    }
+
+                } else if (is_reserved(elt)) {
+                    if (reserved_element(elt)->hash == hash) {
+                        // Another insert of the same hash is under way: wait for it and look again.
+                        while (hashmap[bucket].load(std::memory_order_acquire) == elt) {
+                            std::this_thread::yield();
+                        }
+                        again = true;
+                        break;
+                    }
+
+                } else if (elt->hash == hash) {
+                    drop();
+                    mark_dirty(bucket);
+                    return { elt, false };
+                }
+                hash2 = hashfun2(hash2);
+            }
+
+            if (again) {
+                continue;
+            }
+            if (free == SIZE) {
+                drop();
+                return { nullptr, false };
+            }
+            if (newelt == nullptr) {
+                newelt = make();
+            }
+
+            if constexpr (!CONCURRENT) {
+                hashmap[free].store(newelt, std::memory_order_relaxed);
+                occupied[free / 64].store(occupied[free / 64].load(std::memory_order_relaxed) | (uint64_t(1) << (free % 64)),
+                                          std::memory_order_relaxed);
+                mark_dirty(free);
+                notify_insert(newelt);
+                return { newelt, true };
+
+            } else if (!erasable) {
+                if (!hashmap[free].compare_exchange_strong(free_was, newelt, std::memory_order_release, std::memory_order_relaxed)) {
+                    // Lost the slot; look again.
+                    continue;
+                }
+
+                mark_occupied(free);
+                mark_dirty(free);
+                notify_insert(newelt);
+                return { newelt, true };
+
+            } else {
+                if (!hashmap[free].compare_exchange_strong(free_was, reservation_of(newelt), std::memory_order_seq_cst)) {
+                    // Lost the slot; look again.
+                    continue;
+                }
+                shown = true;
+
+                if (has_ghosts.load(std::memory_order_seq_cst) && !settle(hash, hashfun2, maxtries, free, newelt)) {
+                    continue;
+                }
+                Element* reserved = reservation_of(newelt);
+                if (!hashmap[free].compare_exchange_strong(reserved, newelt, std::memory_order_seq_cst)) {
+                    // Removed by an insert of the same hash that comes first in the chain.
+                    continue;
+                }
+
+                mark_occupied(free);
+                mark_dirty(free);
+                notify_insert(newelt);
+                return { newelt, true };
+            }
+        }
+    }
+
+    /*
+     * Checks the chain of hash again once newelt is reserved in slot mine, since another insert
+     * of the same hash may have reserved an earlier or later free slot meanwhile. A live entry of
+     * the hash wins over any reservation, and among reservations the one first in the chain wins
+     * and turns later ones into ghosts. Every insert reserves before it checks, so of two racing
+     * inserts at least one sees the other. Returns whether newelt may be published; if not, its
+     * slot has been given up.
+     */
+    bool settle(size_t hash, auto&& hashfun2, size_t maxtries, size_t mine, Element* newelt) {
+        Element* reserved = reservation_of(newelt);
+        size_t hash2 = hash;
+        bool before_mine = true;
+
+        auto same_hash = [&](Element* elt) {
+            if (is_reserved(elt)) {
+                return reserved_element(elt)->hash == hash;
+            }
+            return is_live(elt) && elt->hash == hash;
+        };
+
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            size_t bucket = hash2 % SIZE;
+            Element* elt = hashmap[bucket].load(std::memory_order_seq_cst);
+            hash2 = hashfun2(hash2);
+
+            if (elt == nullptr) {
+                break;
+            }
+            if (bucket == mine) {
+                // A chain can come back to a slot; only the first visit counts.
+                if (before_mine && elt != reserved) {
+                    return false;
+                }
+                before_mine = false;
+                continue;
+            }
+
+            bool same = same_hash(elt);
+            while (same && !before_mine && is_reserved(elt)) {
+                same = !hashmap[bucket].compare_exchange_strong(elt, ghost_of(hash), std::memory_order_seq_cst) && same_hash(elt);
+            }
+            if (same) {
+                hashmap[mine].compare_exchange_strong(reserved, ghost_of(hash), std::memory_order_seq_cst);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* The hash of an erased entry, for take_erased(). */
+    struct tombstone {
+        size_t hash;
+        tombstone* next;
+    };
+
+    /* An erased element, or one that other threads may have seen in a reservation; freed by reclaim(). */
+    struct retired {
+        Element* elt;
+        retired* next;
+    };
+
+    /*
+     * Besides null and an element, a slot can hold a ghost left by an erase (its hash with the
+     * lowest bit set) or a reservation (an element being inserted, with the second bit set).
+     * Elements are aligned, so no Element* has either bit.
+     */
+    static_assert(alignof(Element) >= 4);
+
+    static Element* ghost_of(size_t hash) {
+        return reinterpret_cast<Element*>(uintptr_t(hash | 1));
+    }
+
+    static bool is_ghost(const Element* elt) {
+        return reinterpret_cast<uintptr_t>(elt) & 1;
+    }
+
+    static Element* reservation_of(Element* elt) {
+        return reinterpret_cast<Element*>(reinterpret_cast<uintptr_t>(elt) | 2);
+    }
+
+    static bool is_reserved(const Element* elt) {
+        return (reinterpret_cast<uintptr_t>(elt) & 3) == 2;
+    }
+
+    static Element* reserved_element(Element* elt) {
+        return reinterpret_cast<Element*>(reinterpret_cast<uintptr_t>(elt) & ~uintptr_t(3));
+    }
+
+    static bool is_live(const Element* elt) {
+        return elt != nullptr && (reinterpret_cast<uintptr_t>(elt) & 3) == 0;
+    }
+
+    void retire_element(Element* elt) {
+        retired* r = new retired{ elt, erased.load(std::memory_order_relaxed) };
+        while (!erased.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    // Elements from arena blocks are destroyed in place, the blocks are freed with the map.
+    void destroy(const std::vector<Element*>& elements) {
+        std::vector<arena*> blocks;
+        for (arena* a = arenas.load(std::memory_order_acquire); a != nullptr; a = a->next) {
+            blocks.push_back(a);
+        }
+        std::sort(blocks.begin(), blocks.end(), [](arena* a, arena* b) { return std::less<Element*>()(a->first, b->first); });
+
+        for (Element* elt : elements) {
+            auto i = std::upper_bound(blocks.begin(), blocks.end(), elt, [](Element* e, arena* a) { return std::less<Element*>()(e, a->first); });
+
+            if (i != blocks.begin() && (*(i - 1))->owns(elt)) {
+                elt->~Element();
+            } else {
+                delete elt;
+            }
+        }
+    }
+
+    // One bit per slot, set after the slot is filled; lets iteration skip empty regions.
+    void mark_occupied(size_t bucket) {
+        occupied[bucket / 64].fetch_or(uint64_t(1) << (bucket % 64), std::memory_order_release);
+    }
+
+    void mark_dirty(size_t bucket) {
+        if (dirty) {
+            size_t region = bucket >> dirty_shift;
+            std::atomic<uint64_t>& word = dirty[region / 64];
+            uint64_t bit = uint64_t(1) << (region % 64);
+
+            // Only write when the bit is not set yet, so that hot regions don't bounce the cache line.
+            if (!(word.load(std::memory_order_relaxed) & bit)) {
+                word.fetch_or(bit, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // After a write: always set the bit, with release, so that a take_dirty() that clears it first sees the write.
+    void mark_written(size_t bucket) {
+        size_t region = bucket >> dirty_shift;
+        dirty[region / 64].fetch_or(uint64_t(1) << (region % 64), std::memory_order_release);
+    }
+
+    void notify_insert(Element* elt) {
+        if (insert_hook != nullptr) {
+            insert_hook(insert_hook_ctx, elt->hash, &elt->val);
+        }
+    }
 
     std::array<std::atomic<Element*>, SIZE> hashmap;
-    
+    std::array<std::atomic<uint64_t>, WORDS> occupied;
+    std::atomic<arena*> arenas = nullptr;
+    std::atomic<retired*> erased = nullptr;
+    bool erasable = false;
+    std::atomic<bool> has_ghosts = false;
+    std::atomic<tombstone*> tombstones = nullptr;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> dirty;
+    size_t dirty_shift = 0;
+
+    void (*insert_hook)(void*, size_t, VALUE*) = nullptr;
+    void* insert_hook_ctx = nullptr;
 };
 
+/* Merges src into dst, see map::merge_from(). */
+template <size_t SIZE, typename KEY, typename VALUE>
+auto merge_into(map<SIZE, KEY, VALUE>& dst, map<SIZE, KEY, VALUE>& src, auto&& combiner, auto&& hashfun2, auto&& pool) {
+    return dst.merge_from({ &src }, combiner, hashfun2, pool);
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+auto merge_into(map<SIZE, KEY, VALUE>& dst, map<SIZE, KEY, VALUE>& src, auto&& combiner, auto&& hashfun2) {
+    return dst.merge_from({ &src }, combiner, hashfun2, default_pool());
+}
+
 }
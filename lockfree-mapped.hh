@@ -0,0 +1,204 @@
+#pragma once
+
+/*
+ * A read-only view of a map persisted in a position-independent layout, queried directly
+ * from a shared memory mapping of the file.
+ *
+ * write_mapped() lays a map out as a slot table that mirrors the map's slots one to one, with
+ * record indices instead of Element pointers, followed by the (hash, value) records. Slots
+ * that held a ghost of an erased entry are marked so that probes go on past them.
+ * mapped_view opens such a file with a single mmap(): there is nothing to deserialize, so
+ * opening is O(1) regardless of size, and the page cache pages are shared by every process
+ * that maps the same file. Since the slots are in the same place as in the map, find() probes
+ * exactly like map::find(), with the same hash functions.
+ *
+ * VALUE must be trivially copyable; records are padded to 8 bytes, so values with an alignment
+ * of up to 8 can be read in place.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "lockfree-map.hh"
+#include "lockfree-snapshot.hh"
+
+namespace lockfree {
+
+struct mapped_header {
+    char magic[8] = { 'L', 'F', 'M', 'A', 'P', 'V', 'E', 'W' };
+    // Version 2 adds GHOST slots.
+    uint32_t version = 2;
+    uint32_t record_size = 0;
+    uint64_t slots = 0;
+    uint64_t value_size = 0;
+    uint64_t count = 0;
+    uint64_t slots_offset = 0;
+    uint64_t records_offset = 0;
+
+    // A slot value that is not a record index: the slot held a ghost, probes go on.
+    static constexpr uint64_t GHOST = UINT64_MAX;
+};
+
+template <typename VALUE>
+struct mapped_record {
+    uint64_t hash;
+    VALUE val;
+};
+
+/* Writes m in the mapped_view layout to path. Like snapshot(), this is fuzzy under concurrent inserts. */
+template <size_t SIZE, typename KEY, typename VALUE>
+size_t write_mapped(map<SIZE, KEY, VALUE>& m, const std::string& path, auto&& pool) {
+    static_assert(std::is_trivially_copyable_v<VALUE>, "Mapped views store the raw bytes of the values.");
+    static_assert(alignof(VALUE) <= 8, "Mapped views align records to 8 bytes.");
+
+    using record = mapped_record<VALUE>;
+
+    auto parts = m.partition(pool.concurrency() * 16);
+    std::vector<std::vector<std::pair<size_t, record>>> buffers(parts.size());
+    std::vector<std::vector<size_t>> ghosts(parts.size());
+
+    pool.parallel_for(parts.size(), [&](size_t p) {
+        for (auto i = parts[p].begin(); i != parts[p].end(); ++i) {
+            buffers[p].push_back({ i.bucket, record{ i.hash(), *i } });
+        }
+        m.for_each_ghost(parts[p].first, parts[p].last, [&](size_t slot) { ghosts[p].push_back(slot); });
+    });
+
+    std::vector<size_t> first(parts.size() + 1, 0);
+    for (size_t p = 0; p < parts.size(); ++p) {
+        first[p + 1] = first[p] + buffers[p].size();
+    }
+
+    mapped_header header;
+    header.record_size = sizeof(record);
+    header.slots = SIZE;
+    header.value_size = sizeof(VALUE);
+    header.count = first.back();
+    header.slots_offset = sizeof(mapped_header);
+    header.records_offset = header.slots_offset + SIZE * sizeof(uint64_t);
+
+    size_t bytes = header.records_offset + header.count * sizeof(record);
+
+    io::file f(path + ".tmp", O_RDWR | O_CREAT | O_TRUNC);
+    // The file starts as a hole: slots that stay empty are never written.
+    f.resize(bytes);
+
+    {
+        io::mapping out(f, true);
+        std::memcpy(out.data, &header, sizeof(header));
+
+        uint64_t* slots = (uint64_t*)(out.data + header.slots_offset);
+        record* records = (record*)(out.data + header.records_offset);
+
+        pool.parallel_for(parts.size(), [&](size_t p) {
+            // A slot whose ghost was taken by an entry after the ghost scan holds the entry.
+            for (size_t slot : ghosts[p]) {
+                slots[slot] = mapped_header::GHOST;
+            }
+            for (size_t i = 0; i < buffers[p].size(); ++i) {
+                slots[buffers[p][i].first] = first[p] + i + 1;
+                std::memcpy((void*)&records[first[p] + i], &buffers[p][i].second, sizeof(record));
+            }
+        });
+    }
+
+    io::commit_file(f, path);
+    return bytes;
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+size_t write_mapped(map<SIZE, KEY, VALUE>& m, const std::string& path) {
+    return write_mapped(m, path, default_pool());
+}
+
+template <typename VALUE>
+class mapped_view {
+    using record = mapped_record<VALUE>;
+
+    io::file f;
+    io::mapping data;
+    mapped_header header;
+    const uint64_t* slots = nullptr;
+    const record* records = nullptr;
+
+public:
+
+    mapped_view(const std::string& path) : f(path, O_RDONLY), data(f) {
+        if (data.size < sizeof(mapped_header)) {
+            throw std::runtime_error("Truncated mapped map: " + path);
+        }
+
+        header = io::load<mapped_header>(data.data);
+
+        if (std::memcmp(header.magic, mapped_header().magic, sizeof(header.magic)) != 0 || (header.version != 1 && header.version != 2)) {
+            throw std::runtime_error("Not a mapped map: " + path);
+        }
+        if (header.value_size != sizeof(VALUE) || header.record_size != sizeof(record)) {
+            throw std::runtime_error("Mapped map value size does not match: " + path);
+        }
+        // Checked without overflow, so that a corrupt header is an error rather than a bad read.
+        bool layout = header.slots > 0 && header.slots_offset >= sizeof(mapped_header) &&
+                      header.slots_offset % alignof(uint64_t) == 0 && header.records_offset % 8 == 0 &&
+                      header.slots_offset <= header.records_offset &&
+                      header.slots <= (header.records_offset - header.slots_offset) / sizeof(uint64_t);
+        if (!layout) {
+            throw std::runtime_error("Corrupt mapped map header: " + path);
+        }
+        if (header.records_offset > data.size || header.count > (data.size - header.records_offset) / sizeof(record)) {
+            throw std::runtime_error("Truncated mapped map: " + path);
+        }
+
+        slots = (const uint64_t*)(data.data + header.slots_offset);
+        records = (const record*)(data.data + header.records_offset);
+    }
+
+    const VALUE* find_hashed(size_t hash, auto&& hashfun2, size_t maxtries = 32) const {
+        size_t hash2 = hash;
+
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            uint64_t index = slots[hash2 % header.slots];
+
+            if (index == 0) {
+                return nullptr;
+            } else if (index == mapped_header::GHOST) {
+                hash2 = hashfun2(hash2);
+                continue;
+            } else if (index > header.count) {
+                throw std::runtime_error("Corrupt mapped map: slot " + std::to_string(hash2 % header.slots) +
+                                         " points past the records");
+            }
+
+            const record& r = records[index - 1];
+
+            if (r.hash == hash) {
+                return &r.val;
+            }
+            hash2 = hashfun2(hash2);
+        }
+        return nullptr;
+    }
+
+    template <typename KEY>
+    const VALUE* find(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) const {
+        return find_hashed(hashfun1(key), hashfun2, maxtries);
+    }
+
+    size_t size() const {
+        return header.count;
+    }
+
+    const record* begin() const {
+        return records;
+    }
+
+    const record* end() const {
+        return records + header.count;
+    }
+};
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Executor backed by the standard parallel algorithms. Kept out of lockfree-executor.hh so the
+ * map does not pull in <execution> (and with it TBB on some standard libraries) unless asked to.
+ */
+
+#include "lockfree-executor.hh"
+
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+namespace lockfree {
+
+/* Hands the work to std::execution::par; only parallel if the standard library has a parallel backend. */
+struct par_executor {
+
+    size_t concurrency() const {
+        return std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+    }
+
+    void parallel_for(size_t n, auto&& fn) {
+        std::vector<size_t> index(n);
+        std::iota(index.begin(), index.end(), 0);
+        std::for_each(std::execution::par, index.begin(), index.end(), [&](size_t i) { fn(i); });
+    }
+};
+
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+/*
+ * A follower that tails the write-ahead log of another process (see lockfree-wal.hh), to keep
+ * a read replica of its map for iteration and analytics off the ingest process.
+ *
+ *   lockfree::wal_follower<record_t> follower("counters.wal");
+ *
+ *   while (running) {
+ *       follower.poll([&](const record_t* r, size_t n) {
+ *           replica.bulk_emplace(n, [&](size_t i) { return r[i].hash; },
+ *                                   [&](size_t i) { return counter_t(r[i]); },
+ *                                   [&](counter_t& c, size_t i) { c.total = std::max(c.total, r[i].total); },
+ *                                   hash2, pool);
+ *       });
+ *   }
+ *
+ * poll() reads the committed frames that were appended since the last call and hands all their
+ * records to the callback as one batch, so the replica applies them through the parallel bulk
+ * path. A frame that is still being written is left for the next call. When the writer
+ * truncates the log, the follower switches to the new file at the same log position; if it
+ * was so far behind that the records it still needed were dropped, poll() throws and the
+ * replica has to be rebuilt from a snapshot.
+ *
+ * lag() can be read from any thread while another one polls.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "lockfree-wal.hh"
+
+namespace lockfree {
+
+template <typename RECORD>
+class wal_follower {
+    std::string path;
+    std::unique_ptr<io::file> f;
+    uint64_t base = 0;
+
+    std::vector<char> chunk;
+    std::vector<RECORD> batch;
+
+    std::atomic<uint64_t> position;
+    std::atomic<uint64_t> commit_time = 0;
+
+    void open() {
+        f = std::make_unique<io::file>(path, O_RDONLY);
+
+        wal_header header;
+        f->pread_all(&header, sizeof(header), 0);
+        header.check(path, sizeof(RECORD));
+        base = header.base;
+
+        if (position.load(std::memory_order_relaxed) < base) {
+            throw std::runtime_error("Log follower is behind the truncated part of " + path);
+        }
+    }
+
+    // truncate() renames a new file over the log; follow it.
+    void reopen_if_replaced() {
+        struct stat now;
+        struct stat open_file;
+        if (::stat(path.c_str(), &now) == 0 && ::fstat(f->fd, &open_file) == 0 && now.st_ino != open_file.st_ino) {
+            open();
+        }
+    }
+
+public:
+
+    struct lag_info {
+        // Committed log bytes not applied yet.
+        size_t bytes;
+        // Age of the newest applied commit, 0 when there is nothing left to apply.
+        double seconds;
+    };
+
+    /* Starts at the given log position; 0 is the first frame ever written. */
+    explicit wal_follower(const std::string& path_, uint64_t start = 0) : path(path_), position(start) {
+        open();
+        position.store(std::max(start, base), std::memory_order_relaxed);
+    }
+
+    /* Calls apply(records, n) once with the records of all new complete frames, up to about max_bytes; returns n. */
+    size_t poll(auto&& apply, size_t max_bytes = size_t(1) << 24) {
+        reopen_if_replaced();
+
+        uint64_t pos = position.load(std::memory_order_relaxed);
+        size_t offset = pos - base + sizeof(wal_header);
+        size_t size = f->size();
+
+        if (size <= offset) {
+            return 0;
+        }
+
+        chunk.resize(std::min(size - offset, std::max<size_t>(max_bytes, sizeof(wal_frame))));
+        f->pread_all(chunk.data(), chunk.size(), offset);
+
+        batch.clear();
+        size_t at = 0;
+        uint64_t time = 0;
+
+        while (wal_frame::valid(chunk.data() + at, chunk.size() - at, sizeof(RECORD))) {
+            auto frame = io::load<wal_frame>(chunk.data() + at);
+            size_t first = batch.size();
+
+            batch.resize(first + frame.count);
+            std::memcpy((void*)(batch.data() + first), chunk.data() + at + sizeof(wal_frame), frame.count * sizeof(RECORD));
+
+            at += sizeof(wal_frame) + frame.count * sizeof(RECORD);
+            time = frame.time;
+        }
+
+        // A frame larger than max_bytes: read it whole.
+        if (at == 0 && chunk.size() < size - offset && chunk.size() >= sizeof(wal_frame)) {
+            auto frame = io::load<wal_frame>(chunk.data());
+            size_t need = sizeof(wal_frame) + frame.count * sizeof(RECORD);
+            if (need > chunk.size() && need <= size - offset) {
+                return poll(apply, need);
+            }
+        }
+
+        if (!batch.empty()) {
+            apply((const RECORD*)batch.data(), batch.size());
+            commit_time.store(time, std::memory_order_relaxed);
+        }
+        position.store(pos + at, std::memory_order_release);
+        return batch.size();
+    }
+
+    /* Log position of the next record to apply. */
+    uint64_t applied() const {
+        return position.load(std::memory_order_acquire);
+    }
+
+    /* How far the replica is behind the log right now. */
+    lag_info lag() const {
+        uint64_t pos = position.load(std::memory_order_acquire);
+
+        // Look at the log itself, not at the file poll() has open, which may have been replaced.
+        io::file current(path, O_RDONLY);
+        wal_header header;
+        current.pread_all(&header, sizeof(header), 0);
+        uint64_t last = header.base + (current.size() - sizeof(wal_header));
+
+        if (last <= pos) {
+            return { 0, 0.0 };
+        }
+
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        uint64_t time = commit_time.load(std::memory_order_relaxed);
+        return { last - pos, time == 0 || now < time ? 0.0 : (now - time) / 1e9 };
+    }
+};
+
+}
@@ -0,0 +1,333 @@
+#pragma once
+
+/*
+ * A lockfree map in a shared memory segment, for counters shared by several processes.
+ *
+ * The segment holds a small header, the slot array and an arena of elements. Slots store the
+ * byte offset of their element from the start of the segment instead of a pointer, so every
+ * process can map the segment at a different address. get() follows the same lock-free
+ * protocol as map::get(): the element is written into the arena first and published with a
+ * compare-and-swap on the slot.
+ *
+ * The segment is either anonymous (a memfd: share it with fork(), or pass file_descriptor()
+ * to another process), or named (shm_open()): the first process to open a name creates the
+ * segment, the others attach to it. Named segments stay until shm_map::unlink() is called.
+ *
+ * KEY and VALUE must be trivially copyable; elements are never destroyed. Values that are
+ * updated concurrently should be changed through std::atomic_ref.
+ * The arena holds `capacity` elements; when it is full, get() returns a null pointer.
+ *
+ * Errors are reported with std::runtime_error.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lockfree-snapshot.hh"
+
+namespace lockfree {
+
+struct shm_header {
+    char magic[8] = { 'L', 'F', 'M', 'A', 'P', 'S', 'H', 'M' };
+    uint32_t version = 1;
+    uint32_t element_size = 0;
+    uint64_t slots = 0;
+    uint64_t capacity = 0;
+    uint64_t table_offset = 0;
+    uint64_t elements_offset = 0;
+
+    // Updated with std::atomic_ref by every process.
+    alignas(64) uint64_t used = 0;
+    uint64_t spare = 0;
+    uint64_t ready = 0;
+};
+
+template <size_t SIZE, typename KEY, typename VALUE>
+class shm_map {
+    static_assert(std::is_trivially_copyable_v<KEY> && std::is_trivially_copyable_v<VALUE>,
+                  "Shared memory maps store keys and values as raw bytes.");
+    static_assert(std::atomic_ref<uint64_t>::is_always_lock_free, "Slots must be lock-free across processes.");
+
+    struct element {
+        uint64_t hash;
+        VALUE val;
+    };
+
+    static constexpr size_t TABLE_OFFSET = (sizeof(shm_header) + 63) / 64 * 64;
+    static constexpr size_t ELEMENTS_OFFSET = (TABLE_OFFSET + SIZE * sizeof(uint64_t) + 63) / 64 * 64;
+
+    int fd = -1;
+    char* base = nullptr;
+    size_t bytes = 0;
+
+    static size_t segment_size(size_t capacity) {
+        return ELEMENTS_OFFSET + capacity * sizeof(element);
+    }
+
+    shm_header& header() const {
+        return *(shm_header*)base;
+    }
+
+    std::atomic_ref<uint64_t> slot(size_t bucket) const {
+        return std::atomic_ref<uint64_t>(((uint64_t*)(base + TABLE_OFFSET))[bucket]);
+    }
+
+    element* at(uint64_t offset) const {
+        return (element*)(base + offset);
+    }
+
+    void map_segment(size_t n, const std::string& name) {
+        void* p = ::mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            io::fail("Could not map", name);
+        }
+        base = (char*)p;
+        bytes = n;
+    }
+
+    void close_segment() {
+        if (base != nullptr) {
+            ::munmap(base, bytes);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    void create(size_t capacity, const std::string& name) {
+        if (::ftruncate(fd, segment_size(capacity)) < 0) {
+            io::fail("Could not resize", name);
+        }
+        map_segment(segment_size(capacity), name);
+
+        // The new segment is zero-filled: every slot is empty.
+        shm_header* h = new (base) shm_header;
+        h->element_size = sizeof(element);
+        h->slots = SIZE;
+        h->capacity = capacity;
+        h->table_offset = TABLE_OFFSET;
+        h->elements_offset = ELEMENTS_OFFSET;
+        std::atomic_ref<uint64_t>(h->ready).store(1, std::memory_order_release);
+    }
+
+    void attach(const std::string& name) {
+        // The creator may still be sizing and initializing the segment.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        struct stat st;
+
+        while (true) {
+            if (::fstat(fd, &st) < 0) {
+                io::fail("Could not stat", name);
+            }
+            if (base == nullptr && (size_t)st.st_size >= sizeof(shm_header)) {
+                map_segment(st.st_size, name);
+            }
+            if (base != nullptr && std::atomic_ref<uint64_t>(header().ready).load(std::memory_order_acquire) == 1) {
+                break;
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                throw std::runtime_error("Shared memory map was never initialized: " + name);
+            }
+            std::this_thread::yield();
+        }
+
+        const shm_header& h = header();
+        if (std::memcmp(h.magic, shm_header().magic, sizeof(h.magic)) != 0 || h.version != 1) {
+            throw std::runtime_error("Not a shared memory map: " + name);
+        }
+        if (h.slots != SIZE || h.element_size != sizeof(element) || bytes < segment_size(h.capacity)) {
+            throw std::runtime_error("Shared memory map layout does not match: " + name);
+        }
+    }
+
+    // Returns the offset of a new element, 0 when the arena is full.
+    template <typename... Args>
+    uint64_t allocate(size_t hash, Args&&... args) {
+        shm_header& h = header();
+        uint64_t offset = std::atomic_ref<uint64_t>(h.spare).exchange(0, std::memory_order_acquire);
+
+        if (offset == 0) {
+            uint64_t i = std::atomic_ref<uint64_t>(h.used).fetch_add(1, std::memory_order_relaxed);
+            if (i >= h.capacity) {
+                return 0;
+            }
+            offset = ELEMENTS_OFFSET + i * sizeof(element);
+        }
+
+        new (at(offset)) element{ hash, VALUE(std::forward<Args>(args)...) };
+        return offset;
+    }
+
+    // Elements can't be freed; one that lost its race is kept for the next insert, unless
+    // another one is kept already: that one is never overwritten, and this one stays unused.
+    void release(uint64_t offset) {
+        if (offset != 0) {
+            uint64_t empty = 0;
+            std::atomic_ref<uint64_t>(header().spare).compare_exchange_strong(empty, offset, std::memory_order_release,
+                                                                              std::memory_order_relaxed);
+        }
+    }
+
+public:
+
+    /* An anonymous segment, shared with the children forked after this call. */
+    explicit shm_map(size_t capacity = SIZE) {
+        fd = ::memfd_create("lockfree-shm-map", MFD_CLOEXEC);
+        if (fd < 0) {
+            io::fail("Could not create", "memfd");
+        }
+        try {
+            create(capacity, "memfd");
+        } catch (...) {
+            close_segment();
+            throw;
+        }
+    }
+
+    /* Creates the named segment, or attaches to it if another process already did; capacity only applies on creation. */
+    explicit shm_map(const std::string& name, size_t capacity = SIZE) {
+        fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        bool created = (fd >= 0);
+
+        if (!created && errno == EEXIST) {
+            fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+        }
+        if (fd < 0) {
+            io::fail("Could not open", name);
+        }
+
+        try {
+            if (created) {
+                create(capacity, name);
+            } else {
+                attach(name);
+            }
+        } catch (...) {
+            close_segment();
+            throw;
+        }
+    }
+
+    shm_map(const shm_map&) = delete;
+    shm_map& operator=(const shm_map&) = delete;
+
+    ~shm_map() {
+        close_segment();
+    }
+
+    /* Removes the name; processes that have the segment mapped keep using it. */
+    static void unlink(const std::string& name) {
+        if (::shm_unlink(name.c_str()) < 0 && errno != ENOENT) {
+            io::fail("Could not unlink", name);
+        }
+    }
+
+    /* The segment's file descriptor, e.g. to send to another process over a unix socket. */
+    int file_descriptor() const {
+        return fd;
+    }
+
+    VALUE* get(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return emplace_hashed(hashfun1(key), hashfun2, maxtries, key).first;
+    }
+
+    VALUE* find(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        return find_hashed(hashfun1(key), hashfun2, maxtries);
+    }
+
+    VALUE* find_hashed(size_t hash, auto&& hashfun2, size_t maxtries = 32) {
+        size_t hash2 = hash;
+
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            uint64_t offset = slot(hash2 % SIZE).load(std::memory_order_acquire);
+
+            if (offset == 0) {
+                return nullptr;
+            }
+
+            element* elt = at(offset);
+
+            if (elt->hash == hash) {
+                return &elt->val;
+
+            } else if (elt->hash != 0) {
+                hash2 = hashfun2(hash2);
+            }
+        }
+        return nullptr;
+    }
+
+    /* Like map::emplace_hashed(): the value is constructed from args; returns it and whether this call inserted it. */
+    template <typename... Args>
+    std::pair<VALUE*, bool> emplace_hashed(size_t hash, auto&& hashfun2, size_t maxtries, Args&&... args) {
+        size_t hash2 = hash;
+        uint64_t newelt = 0;
+
+        for (size_t tries = 0; tries < maxtries; ++tries) {
+            auto s = slot(hash2 % SIZE);
+            uint64_t offset = s.load(std::memory_order_acquire);
+
+            if (offset == 0) {
+                if (newelt == 0) {
+                    newelt = allocate(hash, std::forward<Args>(args)...);
+                    if (newelt == 0) {
+                        return { nullptr, false };
+                    }
+                }
+
+                if (s.compare_exchange_strong(offset, newelt, std::memory_order_release, std::memory_order_acquire)) {
+                    return { &at(newelt)->val, true };
+                }
+            }
+
+            element* elt = at(offset);
+
+            if (elt->hash == hash) {
+                release(newelt);
+                return { &elt->val, false };
+
+            } else if (elt->hash != 0) {
+                hash2 = hashfun2(hash2);
+            }
+        }
+
+        release(newelt);
+        return { nullptr, false };
+    }
+
+    /* Calls fn(hash, value) for every entry. */
+    void for_each(auto&& fn) {
+        for (size_t i = 0; i < SIZE; ++i) {
+            uint64_t offset = slot(i).load(std::memory_order_acquire);
+            if (offset != 0) {
+                fn(at(offset)->hash, at(offset)->val);
+            }
+        }
+    }
+
+    /* Number of entries; this scans the slots. */
+    size_t size() {
+        size_t n = 0;
+        for_each([&](size_t, const VALUE&) { ++n; });
+        return n;
+    }
+
+    size_t capacity() const {
+        return header().capacity;
+    }
+};
+
+}
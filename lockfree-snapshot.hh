@@ -0,0 +1,530 @@
+#pragma once
+
+/*
+ * Binary snapshots of a lockfree map, for warm restarts.
+ *
+ * A snapshot is a header followed by one record per entry: the 8-byte hash and the raw bytes
+ * of the value, so VALUE must be trivially copyable (keys are not stored by the map; if you
+ * need them back, keep them in the value).
+ * snapshot() copies slot ranges in parallel while other threads keep inserting and updating:
+ * it is a fuzzy snapshot, every entry is taken at some point during the call, and entries
+ * inserted during the call may or may not be included.
+ * restore() inserts the records in parallel through the bulk-load path; a record whose hash
+ * is already in the map overwrites the value.
+ *
+ * With dirty tracking enabled on the map (map::enable_dirty_tracking()), checkpoint() writes a
+ * full snapshot and checkpoint_incremental() writes only the slot regions that changed since
+ * the previous checkpoint, in the same format, followed by the hashes of the entries erased
+ * since then. restore() erases those before it inserts the records. Restoring the base and
+ * then every delta in order, e.g. with restore_incremental(), gives back the state at the
+ * last checkpoint.
+ *
+ * snapshot_format::packed trades CPU for I/O: every slot range is written as a block of
+ * records sorted by hash, with the hashes delta-coded and the hashes and values packed with
+ * Stream VByte (lockfree-varint.hh). It suits small counters whose high bytes are zero.
+ * restore() reads both formats.
+ *
+ * Errors are reported with std::runtime_error.
+ */
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lockfree-map.hh"
+#include "lockfree-varint.hh"
+
+namespace lockfree {
+
+namespace io {
+
+inline void fail(const std::string& what, const std::string& path) {
+    throw std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+/* Owns a file descriptor. */
+struct file {
+    int fd = -1;
+    std::string path;
+
+    file(const std::string& path_, int flags, mode_t mode = 0644) : path(path_) {
+        fd = ::open(path.c_str(), flags | O_CLOEXEC, mode);
+        if (fd < 0) {
+            fail("Could not open", path);
+        }
+    }
+
+    file(const file&) = delete;
+    file& operator=(const file&) = delete;
+
+    ~file() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    size_t size() const {
+        struct stat st;
+        if (::fstat(fd, &st) < 0) {
+            fail("Could not stat", path);
+        }
+        return st.st_size;
+    }
+
+    void pwrite_all(const void* data, size_t n, size_t offset) const {
+        const char* p = (const char*)data;
+        while (n > 0) {
+            ssize_t r = ::pwrite(fd, p, n, offset);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail("Could not write", path);
+            }
+            p += r;
+            n -= r;
+            offset += r;
+        }
+    }
+
+    void pread_all(void* data, size_t n, size_t offset) const {
+        char* p = (char*)data;
+        while (n > 0) {
+            ssize_t r = ::pread(fd, p, n, offset);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail("Could not read", path);
+            }
+            if (r == 0) {
+                throw std::runtime_error("Unexpected end of file " + path);
+            }
+            p += r;
+            n -= r;
+            offset += r;
+        }
+    }
+
+    void sync() const {
+        if (::fdatasync(fd) < 0) {
+            fail("Could not sync", path);
+        }
+    }
+
+    void resize(size_t n) const {
+        if (::ftruncate(fd, n) < 0) {
+            fail("Could not resize", path);
+        }
+    }
+};
+
+/* A shared mapping of a whole file, read-only unless asked otherwise. */
+struct mapping {
+    char* data = nullptr;
+    size_t size = 0;
+
+    mapping(const file& f, bool writable = false) : size(f.size()) {
+        if (size > 0) {
+            void* p = ::mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, f.fd, 0);
+            if (p == MAP_FAILED) {
+                fail("Could not map", f.path);
+            }
+            data = (char*)p;
+        }
+    }
+
+    mapping(const mapping&) = delete;
+    mapping& operator=(const mapping&) = delete;
+
+    ~mapping() {
+        if (data != nullptr) {
+            ::munmap(data, size);
+        }
+    }
+};
+
+template <typename T>
+T load(const char* p) {
+    std::array<char, sizeof(T)> raw;
+    std::memcpy(raw.data(), p, sizeof(T));
+    return std::bit_cast<T>(raw);
+}
+
+/* Writes to path + ".tmp", renames it over path once everything is on disk, and syncs the directory. */
+inline void commit_file(const file& f, const std::string& path) {
+    f.sync();
+    if (::rename(f.path.c_str(), path.c_str()) < 0) {
+        fail("Could not rename", f.path);
+    }
+
+    // The rename is only durable once the directory entry is.
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    file d(dir, O_RDONLY | O_DIRECTORY);
+    if (::fsync(d.fd) < 0) {
+        fail("Could not sync", dir);
+    }
+}
+
+}
+
+struct snapshot_header {
+    char magic[8] = { 'L', 'F', 'M', 'A', 'P', 'S', 'N', 'P' };
+    uint32_t version = 2;
+    uint32_t format = 0;
+    uint64_t slots = 0;
+    uint64_t value_size = 0;
+    uint64_t count = 0;
+    // Since version 2: the number of erased hashes stored after the records.
+    uint64_t erased = 0;
+
+    /* Bytes before the first record; version 1 headers end before erased. */
+    size_t size() const {
+        return version == 1 ? offsetof(snapshot_header, erased) : sizeof(snapshot_header);
+    }
+
+    static snapshot_header read(const io::mapping& data, const std::string& path) {
+        snapshot_header header;
+        if (data.size < offsetof(snapshot_header, erased)) {
+            throw std::runtime_error("Truncated snapshot: " + path);
+        }
+        std::memcpy((void*)&header, data.data, std::min(data.size, sizeof(header)));
+        if (header.version == 1) {
+            header.erased = 0;
+        }
+        if (data.size < header.size()) {
+            throw std::runtime_error("Truncated snapshot: " + path);
+        }
+        return header;
+    }
+
+    void check(const std::string& path, size_t value_size_) const {
+        if (std::memcmp(magic, snapshot_header().magic, sizeof(magic)) != 0 || (version != 1 && version != 2)) {
+            throw std::runtime_error("Not a map snapshot: " + path);
+        }
+        if (value_size != value_size_) {
+            throw std::runtime_error("Snapshot value size does not match: " + path);
+        }
+    }
+};
+
+enum class snapshot_format : uint32_t {
+    // The hash and the raw value bytes of every entry, in slot order.
+    raw = 0,
+    // Blocks of entries sorted by hash, with delta-coded hashes, all packed with Stream VByte.
+    packed = 1,
+};
+
+struct snapshot_stats {
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+namespace packing {
+
+/* A packed block: this, then bytes of Stream VByte data for count records. */
+struct block_header {
+    uint64_t count;
+    uint64_t bytes;
+};
+
+// Every record is coded as the low and high halves of the hash delta, then the value in 32-bit words.
+inline size_t ints_per_record(size_t value_size) {
+    return 2 + (value_size + 3) / 4;
+}
+
+/* Appends a block for count raw records (hash, then value_size bytes) to out. */
+inline void encode_block(const char* records, size_t count, size_t value_size, std::vector<char>& out) {
+    const size_t record = sizeof(uint64_t) + value_size;
+    const size_t per = ints_per_record(value_size);
+
+    std::vector<std::pair<uint64_t, size_t>> order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = { io::load<uint64_t>(records + i * record), i };
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<uint32_t> ints(count * per);
+    uint64_t prev = 0;
+    for (size_t i = 0; i < count; ++i) {
+        auto [ hash, index ] = order[i];
+        const char* r = records + index * record;
+        uint64_t delta = hash - prev;
+        prev = hash;
+
+        uint32_t* at = &ints[i * per];
+        at[0] = (uint32_t)delta;
+        at[1] = (uint32_t)(delta >> 32);
+        std::memcpy(at + 2, r + sizeof(uint64_t), value_size);
+    }
+
+    size_t start = out.size();
+    out.resize(start + sizeof(block_header) + varint::max_bytes(ints.size()));
+    size_t bytes = varint::encode(ints.data(), ints.size(), (uint8_t*)&out[start + sizeof(block_header)]);
+
+    block_header header{ count, bytes };
+    std::memcpy(&out[start], &header, sizeof(header));
+    out.resize(start + sizeof(block_header) + bytes);
+}
+
+/* Decodes the block at p, with available bytes after p, back into raw records; returns its size. */
+inline size_t decode_block(const char* p, size_t available, size_t value_size, char* records) {
+    const size_t record = sizeof(uint64_t) + value_size;
+    const size_t per = ints_per_record(value_size);
+
+    if (available < sizeof(block_header)) {
+        throw std::runtime_error("Truncated packed block");
+    }
+    auto header = io::load<block_header>(p);
+    // Every int takes at least two bits of control bytes.
+    if (header.bytes > available - sizeof(block_header) || header.count > header.bytes * 4 / per) {
+        throw std::runtime_error("Truncated packed block");
+    }
+
+    std::vector<uint32_t> ints(header.count * per);
+    varint::decode((const uint8_t*)p + sizeof(block_header), header.bytes, ints.size(), ints.data());
+
+    uint64_t hash = 0;
+    for (size_t i = 0; i < header.count; ++i) {
+        const uint32_t* at = &ints[i * per];
+        hash += at[0] | (uint64_t(at[1]) << 32);
+        std::memcpy(records + i * record, &hash, sizeof(hash));
+        std::memcpy(records + i * record + sizeof(uint64_t), at + 2, value_size);
+    }
+    return sizeof(block_header) + header.bytes;
+}
+
+}
+
+/* Writes the entries in the given slot ranges of m (from m.partition() or m.take_dirty()) to path, copying the ranges in parallel, then the erased hashes. */
+template <size_t SIZE, typename KEY, typename VALUE>
+snapshot_stats write_snapshot(map<SIZE, KEY, VALUE>& m, const std::vector<typename map<SIZE, KEY, VALUE>::range>& parts,
+                              const std::string& path, auto&& pool, snapshot_format format = snapshot_format::raw,
+                              const std::vector<size_t>& erased = {}) {
+    static_assert(std::is_trivially_copyable_v<VALUE>, "Snapshots store the raw bytes of the values.");
+
+    constexpr size_t RECORD = sizeof(uint64_t) + sizeof(VALUE);
+
+    for (const auto& part : parts) {
+        if (&part.self != &m) {
+            throw std::runtime_error("Snapshot ranges of another map: " + path);
+        }
+    }
+
+    std::vector<std::vector<char>> buffers(parts.size());
+    std::vector<size_t> counts(parts.size());
+
+    pool.parallel_for(parts.size(), [&](size_t p) {
+        std::vector<char>& buf = buffers[p];
+        for (auto i = parts[p].begin(); i != parts[p].end(); ++i) {
+            uint64_t hash = i.hash();
+            size_t at = buf.size();
+            buf.resize(at + RECORD);
+            std::memcpy(&buf[at], &hash, sizeof(hash));
+            std::memcpy(&buf[at + sizeof(hash)], &*i, sizeof(VALUE));
+        }
+
+        counts[p] = buf.size() / RECORD;
+        if (format == snapshot_format::packed) {
+            std::vector<char> block;
+            if (counts[p] > 0) {
+                packing::encode_block(buf.data(), counts[p], sizeof(VALUE), block);
+            }
+            buf.swap(block);
+        }
+    });
+
+    std::vector<size_t> offsets(parts.size() + 1, sizeof(snapshot_header));
+    for (size_t p = 0; p < parts.size(); ++p) {
+        offsets[p + 1] = offsets[p] + buffers[p].size();
+    }
+
+    snapshot_header header;
+    header.slots = SIZE;
+    header.format = (uint32_t)format;
+    header.value_size = sizeof(VALUE);
+    header.erased = erased.size();
+    for (size_t n : counts) {
+        header.count += n;
+    }
+
+    io::file f(path + ".tmp", O_WRONLY | O_CREAT | O_TRUNC);
+    f.pwrite_all(&header, sizeof(header), 0);
+
+    pool.parallel_for(parts.size(), [&](size_t p) {
+        f.pwrite_all(buffers[p].data(), buffers[p].size(), offsets[p]);
+    });
+
+    std::vector<uint64_t> hashes(erased.begin(), erased.end());
+    f.pwrite_all(hashes.data(), hashes.size() * sizeof(uint64_t), offsets.back());
+
+    io::commit_file(f, path);
+    return { header.count, offsets.back() + hashes.size() * sizeof(uint64_t) };
+}
+
+/* Writes a fuzzy snapshot of m to path, copying slot ranges in parallel. */
+template <size_t SIZE, typename KEY, typename VALUE>
+snapshot_stats snapshot(map<SIZE, KEY, VALUE>& m, const std::string& path, auto&& pool,
+                        snapshot_format format = snapshot_format::raw) {
+    return write_snapshot(m, m.partition(pool.concurrency() * 16), path, pool, format);
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+snapshot_stats snapshot(map<SIZE, KEY, VALUE>& m, const std::string& path) {
+    return snapshot(m, path, default_pool());
+}
+
+/* Erases the hashes listed in the snapshot at path from m, then inserts every record; existing values are overwritten. */
+template <size_t SIZE, typename KEY, typename VALUE>
+typename map<SIZE, KEY, VALUE>::bulk_stats restore(map<SIZE, KEY, VALUE>& m, const std::string& path, auto&& hashfun2, auto&& pool) {
+    static_assert(std::is_trivially_copyable_v<VALUE>, "Snapshots store the raw bytes of the values.");
+
+    constexpr size_t RECORD = sizeof(uint64_t) + sizeof(VALUE);
+
+    io::file f(path, O_RDONLY);
+    io::mapping data(f);
+
+    auto header = snapshot_header::read(data, path);
+    header.check(path, sizeof(VALUE));
+
+    // The erased hashes are at the end, after the records.
+    if (header.erased > (data.size - header.size()) / sizeof(uint64_t)) {
+        throw std::runtime_error("Truncated snapshot: " + path);
+    }
+    size_t end = data.size - header.erased * sizeof(uint64_t);
+    if (header.erased > 0 && !m.erase_enabled()) {
+        throw std::runtime_error("Snapshot erases entries, restore it into a map with enable_erase(): " + path);
+    }
+
+    ::madvise(data.data, data.size, MADV_WILLNEED);
+    const char* records = data.data + header.size();
+    std::vector<char> unpacked;
+
+    if (header.format == (uint32_t)snapshot_format::packed) {
+        // Find the blocks, then unpack them in parallel into raw records.
+        std::vector<std::pair<size_t, size_t>> blocks;
+        size_t at = header.size();
+        size_t total = 0;
+
+        while (at + sizeof(packing::block_header) <= end) {
+            auto block = io::load<packing::block_header>(data.data + at);
+            if (block.bytes > end - at - sizeof(packing::block_header) ||
+                block.count > block.bytes * 4 / packing::ints_per_record(sizeof(VALUE))) {
+                break;
+            }
+            blocks.emplace_back(at, total);
+            total += block.count;
+            at += sizeof(packing::block_header) + block.bytes;
+        }
+        if (at != end || total != header.count) {
+            throw std::runtime_error("Truncated snapshot: " + path);
+        }
+
+        unpacked.resize(header.count * RECORD);
+        pool.parallel_for(blocks.size(), [&](size_t b) {
+            auto [ offset, first ] = blocks[b];
+            packing::decode_block(data.data + offset, end - offset, sizeof(VALUE), unpacked.data() + first * RECORD);
+        });
+        records = unpacked.data();
+
+    } else if (header.format != (uint32_t)snapshot_format::raw || end < header.size() ||
+               header.count > (end - header.size()) / RECORD) {
+        throw std::runtime_error("Truncated or unsupported snapshot: " + path);
+    }
+
+    if (header.erased > 0) {
+        const char* erased = data.data + end;
+        size_t chunks = std::min<size_t>(pool.concurrency() * 4, std::max<size_t>(header.erased / 4096, 1));
+        size_t chunk_size = (header.erased + chunks - 1) / chunks;
+
+        pool.parallel_for(chunks, [&](size_t c) {
+            for (size_t i = c * chunk_size; i < std::min<size_t>(header.erased, (c + 1) * chunk_size); ++i) {
+                m.erase_hashed(io::load<uint64_t>(erased + i * sizeof(uint64_t)), hashfun2);
+            }
+        });
+    }
+
+    return m.bulk_emplace(header.count,
+                          [&](size_t i) { return io::load<uint64_t>(records + i * RECORD); },
+                          [&](size_t i) { return io::load<VALUE>(records + i * RECORD + sizeof(uint64_t)); },
+                          [&](VALUE& v, size_t i) { std::memcpy((void*)&v, records + i * RECORD + sizeof(uint64_t), sizeof(VALUE)); },
+                          hashfun2, pool);
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+typename map<SIZE, KEY, VALUE>::bulk_stats restore(map<SIZE, KEY, VALUE>& m, const std::string& path, auto&& hashfun2) {
+    return restore(m, path, hashfun2, default_pool());
+}
+
+/* Clears the map's dirty regions, then writes a full snapshot: the base for later incremental checkpoints. */
+template <size_t SIZE, typename KEY, typename VALUE>
+snapshot_stats checkpoint(map<SIZE, KEY, VALUE>& m, const std::string& path, auto&& pool,
+                          snapshot_format format = snapshot_format::raw) {
+    // Clear first: an update() that races with the copy marks its region again and goes into the next delta.
+    // Writes through pointers from get() are only tracked when they are done before this call.
+    m.take_dirty();
+    m.take_erased();
+    return snapshot(m, path, pool, format);
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+snapshot_stats checkpoint(map<SIZE, KEY, VALUE>& m, const std::string& path) {
+    return checkpoint(m, path, default_pool());
+}
+
+/* Writes the entries of the slot regions that changed since the last checkpoint, and the hashes erased since then. */
+template <size_t SIZE, typename KEY, typename VALUE>
+snapshot_stats checkpoint_incremental(map<SIZE, KEY, VALUE>& m, const std::string& path, auto&& pool,
+                                      snapshot_format format = snapshot_format::raw) {
+    constexpr size_t MAX_RANGE = 1 << 16;
+
+    // Split long runs of dirty regions so that they are spread over the workers.
+    std::vector<typename map<SIZE, KEY, VALUE>::range> parts;
+    for (const auto& r : m.take_dirty()) {
+        for (size_t first = r.first; first < r.last; first += MAX_RANGE) {
+            parts.push_back({ m, first, std::min(first + MAX_RANGE, r.last) });
+        }
+    }
+
+    // Taken before the copy: an entry erased later is either copied here and erased by the next
+    // delta, or already gone. Restoring erases first, so an entry erased and added again comes back.
+    std::vector<size_t> erased = m.take_erased();
+    return write_snapshot(m, parts, path, pool, format, erased);
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+snapshot_stats checkpoint_incremental(map<SIZE, KEY, VALUE>& m, const std::string& path) {
+    return checkpoint_incremental(m, path, default_pool());
+}
+
+/* Restores a base checkpoint followed by its deltas, oldest first. */
+template <size_t SIZE, typename KEY, typename VALUE>
+void restore_incremental(map<SIZE, KEY, VALUE>& m, const std::string& base, const std::vector<std::string>& deltas,
+                         auto&& hashfun2, auto&& pool) {
+    restore(m, base, hashfun2, pool);
+    for (const auto& path : deltas) {
+        restore(m, path, hashfun2, pool);
+    }
+}
+
+template <size_t SIZE, typename KEY, typename VALUE>
+void restore_incremental(map<SIZE, KEY, VALUE>& m, const std::string& base, const std::vector<std::string>& deltas,
+                         auto&& hashfun2) {
+    restore_incremental(m, base, deltas, hashfun2, default_pool());
+}
+
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+/*
+ * Compile-time maps for key sets that are known when the program is built
+ * (protocol opcodes, header names, ...).
+ *
+ *   constexpr auto opcodes = lockfree::make_static_map<std::string_view, int>({
+ *       { "GET", 1 }, { "PUT", 2 }, { "DELETE", 3 }
+ *   });
+ *
+ *   const int* op = opcodes.find("PUT");
+ *
+ * The table is built by the compiler and lives in read-only data, so there is no startup cost.
+ * It is a perfect hash in the hash-and-displace style: keys are grouped into buckets by their
+ * hash, and every bucket gets a displacement, found at compile time, that sends all of its keys
+ * to distinct free slots. A lookup is one hash, one read of the displacement, one read of the
+ * slot and a single key comparison, so unlike the runtime map, keys are compared, not just hashes.
+ * Duplicate keys make the build fail at compile time.
+ */
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace lockfree {
+
+/* Default hash for static maps: integers and anything convertible to std::string_view. */
+template <typename KEY>
+struct static_hash {
+
+    static constexpr uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccd;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53;
+        return x ^ (x >> 33);
+    }
+
+    constexpr uint64_t operator()(const KEY& key) const {
+        if constexpr (std::is_integral_v<KEY> || std::is_enum_v<KEY>) {
+            return mix((uint64_t)key);
+
+        } else {
+            uint64_t hash = 0xcbf29ce484222325;
+            for (char c : std::string_view(key)) {
+                hash ^= (uint8_t)c;
+                hash *= 0x100000001b3;
+            }
+            return mix(hash);
+        }
+    }
+};
+
+template <typename KEY, typename VALUE, size_t N, typename HASH = static_hash<KEY>>
+class static_map {
+
+    static constexpr size_t SLOTS = std::bit_ceil(std::max<size_t>(N, 1)) * 2;
+    static constexpr size_t BUCKETS = std::bit_ceil(std::max<size_t>(N / 2, 1));
+    static constexpr uint32_t MAX_DISPLACEMENT = 1 << 20;
+
+    std::array<std::pair<KEY, VALUE>, N> items;
+    std::array<uint32_t, BUCKETS> displacement;
+    // Index + 1 of the item in each slot, 0 for an empty slot.
+    std::array<uint32_t, SLOTS> slots;
+
+    static constexpr size_t bucket(uint64_t hash) {
+        return (hash >> 32) & (BUCKETS - 1);
+    }
+
+    static constexpr size_t slot(uint64_t hash, uint32_t d) {
+        return static_hash<uint64_t>::mix(hash + d * 0x9e3779b97f4a7c15) & (SLOTS - 1);
+    }
+
+public:
+
+    constexpr static_map(const std::pair<KEY, VALUE> (&in)[N]) : items{}, displacement{}, slots{} {
+        std::array<uint64_t, N> hashes{};
+        std::array<size_t, BUCKETS + 1> start{};
+
+        for (size_t i = 0; i < N; ++i) {
+            items[i] = in[i];
+            hashes[i] = HASH()(in[i].first);
+            ++start[bucket(hashes[i]) + 1];
+        }
+
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            start[b + 1] += start[b];
+        }
+
+        // Items grouped by bucket.
+        std::array<size_t, N> members{};
+        std::array<size_t, BUCKETS> fill{};
+        for (size_t i = 0; i < N; ++i) {
+            size_t b = bucket(hashes[i]);
+            members[start[b] + fill[b]++] = i;
+        }
+
+        // Place the largest buckets first, while there are still many free slots.
+        std::array<size_t, BUCKETS> order{};
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            order[b] = b;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return start[a + 1] - start[a] > start[b + 1] - start[b];
+        });
+
+        for (size_t b : order) {
+            size_t first = start[b];
+            size_t last = start[b + 1];
+
+            if (first == last) {
+                break;
+            }
+
+            // Equal keys have equal hashes, so duplicates always share a bucket.
+            for (size_t i = first; i < last; ++i) {
+                for (size_t j = i + 1; j < last; ++j) {
+                    if (items[members[i]].first == items[members[j]].first) {
+                        throw std::invalid_argument("static_map: duplicate keys");
+                    }
+                }
+            }
+
+            for (uint32_t d = 0; ; ++d) {
+                if (d == MAX_DISPLACEMENT) {
+                    throw std::invalid_argument("static_map: no displacement found");
+                }
+
+                size_t placed = first;
+                while (placed < last && slots[slot(hashes[members[placed]], d)] == 0) {
+                    slots[slot(hashes[members[placed]], d)] = members[placed] + 1;
+                    ++placed;
+                }
+
+                if (placed == last) {
+                    displacement[b] = d;
+                    break;
+                }
+
+                while (placed > first) {
+                    --placed;
+                    slots[slot(hashes[members[placed]], d)] = 0;
+                }
+            }
+        }
+    }
+
+    constexpr const VALUE* find(const KEY& key) const {
+        uint64_t hash = HASH()(key);
+        uint32_t i = slots[slot(hash, displacement[bucket(hash)])];
+
+        if (i == 0 || !(items[i - 1].first == key)) {
+            return nullptr;
+        }
+        return &items[i - 1].second;
+    }
+
+    constexpr size_t size() const {
+        return N;
+    }
+
+    constexpr auto begin() const {
+        return items.begin();
+    }
+
+    constexpr auto end() const {
+        return items.end();
+    }
+};
+
+template <typename KEY, typename VALUE, typename HASH = static_hash<KEY>, size_t N>
+constexpr auto make_static_map(const std::pair<KEY, VALUE> (&items)[N]) {
+    return static_map<KEY, VALUE, N, HASH>(items);
+}
+
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+/*
+ * A two-tier map for key sets with a long tail of entries that are rarely touched again:
+ * hot entries live in a lockfree map, cold ones in an append-only file.
+ *
+ *   lockfree::tiered_map<1 << 20, 1 << 24, std::string, counter_t> counters("counters.cold");
+ *   counters.get(key, hash1, hash2)->value += 1;
+ *   ...
+ *   counters.demote_cold(hash2);      // periodically, e.g. every few seconds
+ *   counters.reclaim();               // when no thread holds value pointers from before
+ *
+ * get() and find() mark the hash as touched. demote_cold() moves every hot entry that was not
+ * touched since the previous call to the end of the file, records its offset in an in-memory
+ * index by hash, and then erases it from the hot map. A lookup that misses the hot map reads
+ * the entry back from the file and inserts it into the hot map again (promotion).
+ * An update made through a pointer obtained before the entry was demoted, and not yet visible
+ * when it was copied out, is lost; entries are only demoted after a whole round without access.
+ *
+ * Files are never compacted: every demotion appends a new copy. VALUE must be trivially copyable.
+ */
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "lockfree-map.hh"
+#include "lockfree-snapshot.hh"
+
+namespace lockfree {
+
+template <size_t HOT_SIZE, size_t COLD_SIZE, typename KEY, typename VALUE>
+class tiered_map {
+    static_assert(std::is_trivially_copyable_v<VALUE>, "Cold entries are stored as raw bytes.");
+
+    // A cold record is the hash followed by the bytes of the value.
+    static constexpr size_t RECORD = sizeof(uint64_t) + sizeof(VALUE);
+
+    map<HOT_SIZE, KEY, VALUE> hot;
+    // Hash -> offset + 1 of the newest copy in the file.
+    map<COLD_SIZE, size_t, std::atomic<uint64_t>> index;
+
+    io::file segment;
+    std::atomic<uint64_t> segment_end = 0;
+
+    // One bit per hash % HOT_SIZE; a shared bit only keeps an entry hot a little longer.
+    std::unique_ptr<std::atomic<uint64_t>[]> touched;
+
+    std::atomic<size_t> promotions = 0;
+    std::atomic<size_t> demotions = 0;
+
+    static constexpr size_t TOUCHED_WORDS = (HOT_SIZE + 63) / 64;
+
+    void touch(size_t hash) {
+        size_t b = hash % HOT_SIZE;
+        std::atomic<uint64_t>& word = touched[b / 64];
+        uint64_t bit = uint64_t(1) << (b % 64);
+
+        if (!(word.load(std::memory_order_relaxed) & bit)) {
+            word.fetch_or(bit, std::memory_order_relaxed);
+        }
+    }
+
+    bool was_touched(size_t hash) const {
+        size_t b = hash % HOT_SIZE;
+        return touched[b / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (b % 64));
+    }
+
+    VALUE* promote(size_t hash, auto&& hashfun2, size_t maxtries) {
+        std::atomic<uint64_t>* at = index.find_hashed(hash, hashfun2, maxtries);
+        uint64_t offset = at ? at->load(std::memory_order_acquire) : 0;
+
+        if (offset == 0) {
+            return nullptr;
+        }
+
+        std::array<char, RECORD> raw;
+        segment.pread_all(raw.data(), RECORD, offset - 1);
+
+        auto [ v, inserted ] = hot.emplace_hashed(hash, hashfun2, maxtries, io::load<VALUE>(raw.data() + sizeof(uint64_t)));
+        if (inserted) {
+            promotions.fetch_add(1, std::memory_order_relaxed);
+        }
+        return v;
+    }
+
+public:
+
+    struct tier_stats {
+        size_t hot = 0;
+        // Entries with a copy in the file, including the ones that were promoted since.
+        size_t cold = 0;
+        size_t promoted = 0;
+        size_t demoted = 0;
+        size_t file_bytes = 0;
+    };
+
+    /* The cold tier goes to a new file at path. */
+    explicit tiered_map(const std::string& path)
+        : segment(path, O_RDWR | O_CREAT | O_TRUNC), touched(std::make_unique<std::atomic<uint64_t>[]>(TOUCHED_WORDS)) {
+        hot.enable_erase();
+    }
+
+    VALUE* get(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        size_t hash = hashfun1(key);
+        touch(hash);
+
+        if (VALUE* v = hot.find_hashed(hash, hashfun2, maxtries)) {
+            return v;
+        }
+        if (VALUE* v = promote(hash, hashfun2, maxtries)) {
+            return v;
+        }
+        return hot.emplace_hashed(hash, hashfun2, maxtries, key).first;
+    }
+
+    /* Like get(), but never inserts; a cold entry is promoted. */
+    VALUE* find(const KEY& key, auto&& hashfun1, auto&& hashfun2, size_t maxtries = 32) {
+        size_t hash = hashfun1(key);
+        touch(hash);
+
+        if (VALUE* v = hot.find_hashed(hash, hashfun2, maxtries)) {
+            return v;
+        }
+        return promote(hash, hashfun2, maxtries);
+    }
+
+    /* Moves the hot entries that were not touched since the last call to the file; returns how many. */
+    size_t demote_cold(auto&& hashfun2, auto&& pool, size_t maxtries = 32) {
+        // The bits are taken before the scan, so that touches made during it count for the next round.
+        std::vector<uint64_t> round(TOUCHED_WORDS);
+        for (size_t w = 0; w < TOUCHED_WORDS; ++w) {
+            round[w] = touched[w].exchange(0, std::memory_order_relaxed);
+        }
+
+        auto parts = hot.partition(pool.concurrency() * 4);
+        std::vector<size_t> moved(parts.size());
+
+        pool.parallel_for(parts.size(), [&](size_t p) {
+            std::vector<uint64_t> hashes;
+            std::vector<char> records;
+            for (auto i = parts[p].begin(); i != parts[p].end(); ++i) {
+                size_t b = i.hash() % HOT_SIZE;
+                bool in_round = round[b / 64] & (uint64_t(1) << (b % 64));
+                if (!in_round && !was_touched(i.hash())) {
+                    uint64_t hash = i.hash();
+                    size_t at = records.size();
+                    records.resize(at + RECORD);
+                    std::memcpy(&records[at], &hash, sizeof(hash));
+                    std::memcpy(&records[at + sizeof(hash)], &*i, sizeof(VALUE));
+                    hashes.push_back(hash);
+                }
+            }
+            if (hashes.empty()) {
+                return;
+            }
+
+            // Write first and index second, so that a lookup that misses the hot map finds the copy.
+            uint64_t offset = segment_end.fetch_add(records.size());
+            segment.pwrite_all(records.data(), records.size(), offset);
+
+            for (size_t r = 0; r < hashes.size(); ++r) {
+                std::atomic<uint64_t>* at = index.emplace_hashed(hashes[r], hashfun2, maxtries, uint64_t(0)).first;
+                if (at == nullptr) {
+                    // The index is full: the entry stays hot.
+                    continue;
+                }
+                at->store(offset + r * RECORD + 1, std::memory_order_release);
+                moved[p] += hot.erase_hashed(hashes[r], hashfun2, maxtries);
+            }
+        });
+
+        size_t total = 0;
+        for (size_t n : moved) {
+            total += n;
+        }
+        demotions.fetch_add(total, std::memory_order_relaxed);
+        return total;
+    }
+
+    size_t demote_cold(auto&& hashfun2) {
+        return demote_cold(hashfun2, default_pool());
+    }
+
+    /* Frees the memory of demoted entries; see map::reclaim(). */
+    size_t reclaim() {
+        return hot.reclaim();
+    }
+
+    /* Entry counts; this scans both maps. */
+    tier_stats stats() {
+        tier_stats ret;
+        for (auto i = hot.begin(); i != hot.end(); ++i) {
+            ++ret.hot;
+        }
+        for (auto i = index.begin(); i != index.end(); ++i) {
+            ++ret.cold;
+        }
+        ret.promoted = promotions.load(std::memory_order_relaxed);
+        ret.demoted = demotions.load(std::memory_order_relaxed);
+        ret.file_bytes = segment_end.load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    /* The hot tier, e.g. to iterate over the entries that are in memory. */
+    map<HOT_SIZE, KEY, VALUE>& hot_map() {
+        return hot;
+    }
+};
+
+}
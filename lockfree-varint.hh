@@ -0,0 +1,122 @@
+#pragma once
+
+/*
+ * Stream VByte coding of 32-bit integers, used by the packed snapshot format.
+ *
+ * Each integer is stored in 1 to 4 little-endian bytes. Its length goes in a 2-bit code,
+ * four codes per control byte, and all control bytes come before all data bytes:
+ *
+ *   [ control bytes: (n + 3) / 4 ][ data bytes ]
+ *
+ * Since the lengths of four integers are known from one control byte without looking at the
+ * data, decode() expands them with a single byte shuffle (SSSE3) when it is available.
+ */
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+namespace lockfree {
+
+namespace varint {
+
+static_assert(std::endian::native == std::endian::little, "The data bytes are the low bytes of the integers.");
+
+inline size_t control_bytes(size_t n) {
+    return (n + 3) / 4;
+}
+
+/* Upper bound of the encoded size of n integers. */
+inline size_t max_bytes(size_t n) {
+    return control_bytes(n) + 4 * n;
+}
+
+inline size_t length_of(uint32_t v) {
+    return v < (uint32_t(1) << 8) ? 1 : v < (uint32_t(1) << 16) ? 2 : v < (uint32_t(1) << 24) ? 3 : 4;
+}
+
+/* Encodes n integers into out, which has room for max_bytes(n); returns the bytes written. */
+inline size_t encode(const uint32_t* in, size_t n, uint8_t* out) {
+    uint8_t* control = out;
+    uint8_t* data = out + control_bytes(n);
+    std::memset(control, 0, control_bytes(n));
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = length_of(in[i]);
+        control[i / 4] |= (len - 1) << (2 * (i % 4));
+        std::memcpy(data, &in[i], len);
+        data += len;
+    }
+    return data - out;
+}
+
+namespace detail {
+
+// For every control byte: the shuffle that spreads its four integers to 32-bit lanes, and their total length.
+struct tables {
+    uint8_t shuffle[256][16];
+    uint8_t length[256];
+
+    constexpr tables() : shuffle(), length() {
+        for (size_t c = 0; c < 256; ++c) {
+            uint8_t pos = 0;
+            for (size_t k = 0; k < 4; ++k) {
+                size_t len = ((c >> (2 * k)) & 3) + 1;
+                for (size_t b = 0; b < 4; ++b) {
+                    shuffle[c][4 * k + b] = (b < len ? pos + b : 0xff);
+                }
+                pos += len;
+            }
+            length[c] = pos;
+        }
+    }
+};
+
+inline constexpr tables TABLES;
+
+}
+
+/* Decodes n integers from the size bytes at in; returns the bytes used. */
+inline size_t decode(const uint8_t* in, size_t size, size_t n, uint32_t* out) {
+    if (size < control_bytes(n)) {
+        throw std::runtime_error("Truncated varint stream");
+    }
+
+    const uint8_t* control = in;
+    const uint8_t* data = in + control_bytes(n);
+    const uint8_t* end = in + size;
+    size_t i = 0;
+
+#if defined(__SSSE3__)
+    // Whole groups of four, as long as a 16-byte load stays inside the input.
+    for (; i + 4 <= n && end - data >= 16; i += 4) {
+        uint8_t c = control[i / 4];
+        __m128i bytes = _mm_loadu_si128((const __m128i*)data);
+        __m128i mask = _mm_loadu_si128((const __m128i*)detail::TABLES.shuffle[c]);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(bytes, mask));
+        data += detail::TABLES.length[c];
+    }
+#endif
+
+    for (; i < n; ++i) {
+        size_t len = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        if ((size_t)(end - data) < len) {
+            throw std::runtime_error("Truncated varint stream");
+        }
+        uint32_t v = 0;
+        std::memcpy(&v, data, len);
+        out[i] = v;
+        data += len;
+    }
+    return data - in;
+}
+
+}
+
+}
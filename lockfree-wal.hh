@@ -0,0 +1,448 @@
+#pragma once
+
+/*
+ * A write-ahead log with group commit, for maps whose updates must survive a crash.
+ *
+ *   lockfree::wal<billing_record> log("billing.wal", std::chrono::milliseconds(2));
+ *
+ *   auto* c = my_map.get(account, hash1, hash2);
+ *   uint64_t total = std::atomic_ref<uint64_t>(c->total).fetch_add(amount) + amount;
+ *   log.append({ hash1(account), total });
+ *   log.sync();    // only if this update must be durable before going on
+ *
+ * append() copies the record into a ring owned by the calling thread, with no shared writes.
+ * A ring is freed once its thread has exited and its records are committed.
+ * A commit thread drains all the rings every commit interval (or sooner when a thread is
+ * waiting in sync()), writes them as one checksummed frame and makes it durable with a single
+ * fdatasync().
+ *
+ * Records of different threads are not logged in the order of the updates, so replay must
+ * not depend on order: e.g. a monotonic counter logs its new total and is replayed with max(),
+ * or a counter logs its deltas and is replayed with +=. Replaying a total is also idempotent,
+ * so a fuzzy snapshot plus the log restores the state:
+ *
+ *   uint64_t mark = log.flush();              // everything appended so far is on disk
+ *   lockfree::snapshot(my_map, "billing.snap");
+ *   log.truncate(mark);                       // drop what the snapshot already holds
+ *
+ *   // recovery
+ *   lockfree::restore(my_map, "billing.snap", hash2);
+ *   lockfree::wal<billing_record>::replay("billing.wal", [&](const billing_record& r) { ... });
+ *
+ * Errors are reported with std::runtime_error; errors in the commit thread end the process.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "lockfree-snapshot.hh"
+
+namespace lockfree {
+
+struct wal_header {
+    char magic[8] = { 'L', 'F', 'M', 'A', 'P', 'W', 'A', 'L' };
+    uint32_t version = 1;
+    uint32_t record_size = 0;
+    // Log position of the first frame: the bytes dropped by truncate() so far.
+    uint64_t base = 0;
+
+    void check(const std::string& path, size_t record_size_) const {
+        if (std::memcmp(magic, wal_header().magic, sizeof(magic)) != 0 || version != 1) {
+            throw std::runtime_error("Not a map log: " + path);
+        }
+        if (record_size != record_size_) {
+            throw std::runtime_error("Log record size does not match: " + path);
+        }
+    }
+};
+
+/* Every commit is one frame: this, then count records. */
+struct wal_frame {
+    uint64_t count;
+    uint64_t checksum;
+    // Commit time, in nanoseconds since the epoch.
+    uint64_t time;
+
+    static uint64_t checksum_of(const char* p, size_t n) {
+        uint64_t hash = 0xcbf29ce484222325;
+        for (size_t i = 0; i < n; ++i) {
+            hash ^= (uint8_t)p[i];
+            hash *= 0x100000001b3;
+        }
+        return hash;
+    }
+
+    /* Whether a whole, intact frame of records of the given size starts at p, with n bytes available. */
+    static bool valid(const char* p, size_t n, size_t record_size) {
+        if (n < sizeof(wal_frame)) {
+            return false;
+        }
+        auto frame = io::load<wal_frame>(p);
+        return frame.count <= (n - sizeof(wal_frame)) / record_size &&
+               checksum_of(p + sizeof(wal_frame), frame.count * record_size) == frame.checksum;
+    }
+};
+
+template <typename RECORD>
+class wal {
+    static_assert(std::is_trivially_copyable_v<RECORD>, "Log records are written as raw bytes.");
+
+    /* A single-producer ring per writing thread; the commit thread is the consumer. */
+    struct buffer {
+        static constexpr uint64_t CAPACITY = 1 << 16;
+
+        buffer* next = nullptr;
+        std::unique_ptr<RECORD[]> records = std::make_unique<RECORD[]>(CAPACITY);
+
+        alignas(64) std::atomic<uint64_t> tail = 0;
+        uint64_t cached_head = 0;
+
+        alignas(64) std::atomic<uint64_t> head = 0;
+        std::atomic<uint64_t> durable = 0;
+
+        // One reference for the log and one for the writing thread; the last one frees the ring.
+        std::atomic<int> refs = 2;
+    };
+
+    static void release(buffer* b) {
+        if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete b;
+        }
+    }
+
+    struct release_buffer {
+        void operator()(buffer* b) const {
+            release(b);
+        }
+    };
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> ids = 1;
+        return ids++;
+    }
+
+    const uint64_t id = next_id();
+    std::string path;
+    std::chrono::microseconds interval;
+
+    std::unique_ptr<io::file> f;
+    size_t end = 0;
+    uint64_t base = 0;
+    std::vector<char> out;
+    size_t syncs = 0;
+
+    std::atomic<buffer*> buffers = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> requested = false;
+    bool stopping = false;
+    std::thread committer;
+
+    buffer* local() {
+        // The rings of this thread by log id. Ids are never reused; the entries of destroyed logs
+        // are dropped when the thread meets a new log, and the rest when the thread exits.
+        static thread_local std::unordered_map<uint64_t, std::unique_ptr<buffer, release_buffer>> mine;
+        static thread_local std::pair<uint64_t, buffer*> last = { 0, nullptr };
+
+        if (last.first == id) {
+            return last.second;
+        }
+
+        auto found = mine.find(id);
+        if (found == mine.end()) {
+            std::erase_if(mine, [](const auto& entry) { return entry.second->refs.load(std::memory_order_acquire) == 1; });
+
+            buffer* b = new buffer;
+            b->next = buffers.load(std::memory_order_relaxed);
+            while (!buffers.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed)) {}
+
+            found = mine.emplace(id, b).first;
+        }
+
+        last = { id, found->second.get() };
+        return last.second;
+    }
+
+    // Unlinks and frees the rings of exited threads once they are drained; called with the mutex held.
+    void drop_orphans(const std::vector<buffer*>& orphans) {
+        for (buffer* o : orphans) {
+            buffer* head = o;
+            if (!buffers.compare_exchange_strong(head, o->next, std::memory_order_acq_rel)) {
+                // Only pushes race with this, and they only change the head.
+                buffer* prev = head;
+                while (prev->next != o) {
+                    prev = prev->next;
+                }
+                prev->next = o->next;
+            }
+            release(o);
+        }
+    }
+
+    void kick() {
+        requested.store(true, std::memory_order_release);
+        wake.notify_one();
+    }
+
+    // Writes everything appended so far as one frame; called with the mutex held.
+    void commit_locked() {
+        out.resize(sizeof(wal_frame));
+        std::vector<std::pair<buffer*, uint64_t>> drained;
+        std::vector<buffer*> orphans;
+
+        for (buffer* b = buffers.load(std::memory_order_acquire); b != nullptr; b = b->next) {
+            // Read before the tail: once the thread is gone, the tail read below is its last one.
+            if (b->refs.load(std::memory_order_acquire) == 1) {
+                orphans.push_back(b);
+            }
+
+            uint64_t h = b->head.load(std::memory_order_relaxed);
+            uint64_t t = b->tail.load(std::memory_order_acquire);
+
+            if (h == t) {
+                continue;
+            }
+
+            size_t at = out.size();
+            out.resize(at + (t - h) * sizeof(RECORD));
+            for (; h < t; ++h, at += sizeof(RECORD)) {
+                std::memcpy(&out[at], &b->records[h % buffer::CAPACITY], sizeof(RECORD));
+            }
+            b->head.store(t, std::memory_order_release);
+            drained.emplace_back(b, t);
+        }
+
+        if (drained.empty()) {
+            drop_orphans(orphans);
+            return;
+        }
+
+        wal_frame frame{ (out.size() - sizeof(wal_frame)) / sizeof(RECORD),
+                         wal_frame::checksum_of(out.data() + sizeof(wal_frame), out.size() - sizeof(wal_frame)),
+                         (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::system_clock::now().time_since_epoch()).count() };
+        std::memcpy(out.data(), &frame, sizeof(frame));
+
+        f->pwrite_all(out.data(), out.size(), end);
+        f->sync();
+        end += out.size();
+        ++syncs;
+
+        for (auto& [ b, t ] : drained) {
+            b->durable.store(t, std::memory_order_release);
+            b->durable.notify_all();
+        }
+        drop_orphans(orphans);
+    }
+
+    void run() {
+        std::unique_lock lock(mutex);
+
+        while (true) {
+            wake.wait_for(lock, interval, [&]() { return stopping || requested.load(std::memory_order_acquire); });
+            requested.store(false, std::memory_order_relaxed);
+            bool stop = stopping;
+
+            commit_locked();
+
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    // Returns the header and the offset just past the last complete, intact frame.
+    static std::pair<wal_header, size_t> scan(const std::string& path, auto&& fn) {
+        io::file in(path, O_RDONLY);
+        io::mapping data(in);
+
+        if (data.size < sizeof(wal_header)) {
+            throw std::runtime_error("Truncated log: " + path);
+        }
+
+        auto header = io::load<wal_header>(data.data);
+        header.check(path, sizeof(RECORD));
+
+        size_t at = sizeof(wal_header);
+
+        // A crash can leave a torn frame at the end; it was never acknowledged, so it is skipped.
+        while (wal_frame::valid(data.data + at, data.size - at, sizeof(RECORD))) {
+            auto frame = io::load<wal_frame>(data.data + at);
+            const char* records = data.data + at + sizeof(wal_frame);
+
+            for (size_t i = 0; i < frame.count; ++i) {
+                fn(io::load<RECORD>(records + i * sizeof(RECORD)));
+            }
+            at += sizeof(wal_frame) + frame.count * sizeof(RECORD);
+        }
+        return { header, at };
+    }
+
+    void create(const std::string& target) {
+        wal_header header;
+        header.record_size = sizeof(RECORD);
+
+        io::file tmp(target + ".tmp", O_WRONLY | O_CREAT | O_TRUNC);
+        tmp.pwrite_all(&header, sizeof(header), 0);
+        io::commit_file(tmp, target);
+    }
+
+public:
+
+    /* Opens the log at path, creating it if needed; new records are appended after the existing ones. */
+    wal(const std::string& path_, std::chrono::microseconds interval_ = std::chrono::milliseconds(1)) : path(path_), interval(interval_) {
+        if (::access(path.c_str(), F_OK) != 0) {
+            create(path);
+        }
+
+        auto [ header, valid ] = scan(path, [](const RECORD&) {});
+        base = header.base;
+        end = valid;
+        f = std::make_unique<io::file>(path, O_RDWR);
+        f->resize(end);
+
+        committer = std::thread([this]() {
+            try {
+                run();
+            } catch (std::exception& e) {
+                std::fprintf(stderr, "lockfree::wal: %s\n", e.what());
+                std::terminate();
+            }
+        });
+    }
+
+    wal(const wal&) = delete;
+    wal& operator=(const wal&) = delete;
+
+    /* Commits what is left and stops the commit thread. */
+    ~wal() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        committer.join();
+
+        // Rings still held by their threads are freed when the threads drop them.
+        buffer* b = buffers.load();
+        while (b != nullptr) {
+            buffer* next = b->next;
+            release(b);
+            b = next;
+        }
+    }
+
+    /* Queues a record; it is durable after the next commit. Waits only if this thread's ring is full. */
+    void append(const RECORD& r) {
+        buffer* b = local();
+        uint64_t t = b->tail.load(std::memory_order_relaxed);
+
+        if (t - b->cached_head == buffer::CAPACITY) {
+            b->cached_head = b->head.load(std::memory_order_acquire);
+            while (t - b->cached_head == buffer::CAPACITY) {
+                kick();
+                std::this_thread::yield();
+                b->cached_head = b->head.load(std::memory_order_acquire);
+            }
+        }
+
+        b->records[t % buffer::CAPACITY] = r;
+        b->tail.store(t + 1, std::memory_order_release);
+    }
+
+    /* Waits until every record appended by this thread is on disk. */
+    void sync() {
+        buffer* b = local();
+        uint64_t t = b->tail.load(std::memory_order_relaxed);
+        uint64_t d = b->durable.load(std::memory_order_acquire);
+
+        if (d < t) {
+            kick();
+        }
+        while (d < t) {
+            b->durable.wait(d);
+            d = b->durable.load(std::memory_order_acquire);
+        }
+    }
+
+    /*
+     * Commits everything appended so far, by any thread; returns the log position it ends at.
+     * Positions count the bytes of all frames ever written, so they stay valid across truncate().
+     */
+    uint64_t flush() {
+        std::lock_guard lock(mutex);
+        commit_locked();
+        return base + (end - sizeof(wal_header));
+    }
+
+    /* Drops the records before position, a value returned by flush(). */
+    void truncate(uint64_t position) {
+        std::lock_guard lock(mutex);
+
+        if (position < base || position > base + (end - sizeof(wal_header))) {
+            throw std::runtime_error("Invalid log position for " + path);
+        }
+        size_t mark = position - base + sizeof(wal_header);
+
+        std::vector<char> rest(end - mark);
+        f->pread_all(rest.data(), rest.size(), mark);
+
+        wal_header header;
+        header.record_size = sizeof(RECORD);
+        header.base = position;
+
+        io::file tmp(path + ".tmp", O_WRONLY | O_CREAT | O_TRUNC);
+        tmp.pwrite_all(&header, sizeof(header), 0);
+        tmp.pwrite_all(rest.data(), rest.size(), sizeof(header));
+        io::commit_file(tmp, path);
+
+        f = std::make_unique<io::file>(path, O_RDWR);
+        end = sizeof(header) + rest.size();
+        base = header.base;
+    }
+
+    /* Number of per-thread rings; the ring of an exited thread goes away with the commit after it. */
+    size_t rings() {
+        std::lock_guard lock(mutex);
+        size_t n = 0;
+        for (buffer* b = buffers.load(std::memory_order_acquire); b != nullptr; b = b->next) {
+            ++n;
+        }
+        return n;
+    }
+
+    /* Number of fdatasync() calls so far. */
+    size_t commits() {
+        std::lock_guard lock(mutex);
+        return syncs;
+    }
+
+    /* Calls fn(record) for every committed record of the log at path; returns how many there were. */
+    static size_t replay(const std::string& path, auto&& fn) {
+        size_t n = 0;
+        scan(path, [&](const RECORD& r) {
+            fn(r);
+            ++n;
+        });
+        return n;
+    }
+};
+
+}
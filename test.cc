@@ -1,12 +1,34 @@
 
 #include "lockfree-map.hh"
+#include "lockfree-frozen.hh"
+#include "lockfree-static-map.hh"
+#include "lockfree-snapshot.hh"
+#include "lockfree-mapped.hh"
+#include "lockfree-shm.hh"
+#include "lockfree-feed.hh"
+#include "lockfree-wal.hh"
+#include "lockfree-replica.hh"
+#include "lockfree-tiered.hh"
+#include "lockfree-file-map.hh"
+#include "lockfree-varint.hh"
+#include "lockfree-aggregate.hh"
+#include "lockfree-join.hh"
+#include "lockfree-dedup.hh"
+#include "lockfree-interner.hh"
 
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <thread>
 #include <mutex>
 #include <random>
 #include <string>
 #include <iostream>
 #include <map>
+#include <set>
+
+#include <sys/wait.h>
 
 uint64_t hash(const char* c, size_t n, uint64_t init = 0xcbf29ce484222325, uint64_t mul = 0x100000001b3) {
 
@@ -131,12 +153,1254 @@ void check(Test& test) {
     }
 }
 
+void check_transform_reduce(Test& test) {
+    int total = 0;
+    for (counter_t& c : test.lf_map) {
+        total += c.counter.load();
+    }
+
+    lockfree::work_stealing_pool pool(4);
+    int par_total = test.lf_map.transform_reduce(0, std::plus<int>(), [](counter_t& c) { return c.counter.load(); });
+    int pool_total = test.lf_map.transform_reduce(pool, 0, std::plus<int>(), [](counter_t& c) { return c.counter.load(); });
+
+    std::cout << "Total: " << total << " parallel total: " << par_total << " pool total: " << pool_total << std::endl;
+    std::cout << (par_total == total && pool_total == total ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_pool() {
+    lockfree::work_stealing_pool pool(4);
+    std::atomic<size_t> total = 0;
+
+    pool.parallel_for(100, [&](size_t i) {
+        pool.parallel_for(1000, [&](size_t j) {
+            total += i * j;
+        });
+    });
+
+    size_t expected = size_t(99 * 100 / 2) * size_t(999 * 1000 / 2);
+
+    std::cout << "Pool total: " << total << " expected: " << expected << std::endl;
+    std::cout << (total == expected ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_bulk() {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < 20000; ++i) {
+        keys.push_back(std::to_string(random(0, 1, 5000)));
+    }
+
+    lockfree::map<16384, std::string, counter_t> seq_map;
+    lockfree::map<16384, std::string, counter_t> bulk_map;
+    lockfree::map<16384, std::string, counter_t> built_map;
+
+    for (const auto& key : keys) {
+        seq_map.get(key, hash_str, hash_size_t);
+    }
+
+    {
+        auto builder = built_map.build_unsynchronized();
+        for (const auto& key : keys) {
+            builder.get(key, hash_str, hash_size_t);
+        }
+    }
+
+    lockfree::work_stealing_pool pool(4);
+    auto stats = bulk_map.bulk_insert(keys, hash_str, hash_size_t, pool);
+
+    std::map<std::string, int> seq_keys;
+    std::map<std::string, int> bulk_keys;
+    std::map<std::string, int> built_keys;
+    for (counter_t& c : seq_map) {
+        seq_keys[c.key] = 1;
+    }
+    for (counter_t& c : bulk_map) {
+        bulk_keys[c.key] = 1;
+    }
+    for (counter_t& c : built_map) {
+        built_keys[c.key] = 1;
+    }
+
+    std::cout << "Bulk inserted: " << stats.inserted << " found: " << stats.found << " failed: " << stats.failed
+              << " sequential keys: " << seq_keys.size() << std::endl;
+
+    bool passed = (seq_keys == bulk_keys && seq_keys == built_keys && stats.inserted == seq_keys.size() && stats.failed == 0 &&
+                   stats.inserted + stats.found == keys.size());
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_merge() {
+    lockfree::map<4096, std::string, counter_t> dst;
+    lockfree::map<4096, std::string, counter_t> src;
+    std::map<std::string, int> expected;
+
+    for (size_t i = 0; i < 3000; ++i) {
+        std::string key = std::to_string(random(0, 1, 2000));
+        lockfree::map<4096, std::string, counter_t>& m = (i % 2 ? dst : src);
+        m.get(key, hash_str, hash_size_t)->counter += 1;
+        expected[key] += 1;
+    }
+
+    lockfree::work_stealing_pool pool(4);
+    auto stats = lockfree::merge_into(dst, src, [](counter_t& d, const counter_t& s) {
+        if (d.key.empty()) {
+            d.key = s.key;
+        }
+        d.counter += s.counter.load();
+    }, hash_size_t, pool);
+
+    std::map<std::string, int> merged;
+    for (counter_t& c : dst) {
+        merged[c.key] = c.counter.load();
+    }
+
+    std::cout << "Merge inserted: " << stats.inserted << " combined: " << stats.found << " failed: " << stats.failed << std::endl;
+    std::cout << (merged == expected && stats.failed == 0 ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_frozen(Test& test) {
+    auto frozen = lockfree::freeze(test.lf_map, [](const counter_t& c) { return c.counter.load(); });
+
+    bool passed = (frozen.size() == test.std_map.size());
+    for (const auto& [ key, val ] : test.std_map) {
+        const int* v = frozen.find(key, hash_str);
+        if (v == nullptr || *v != val) {
+            passed = false;
+        }
+    }
+    if (frozen.find(std::string("not a key"), hash_str) != nullptr) {
+        passed = false;
+    }
+
+    auto sorted = lockfree::freeze_sorted(test.lf_map, [](const counter_t& c) { return c.counter.load(); });
+
+    size_t prev = 0;
+    size_t ordered = 0;
+    sorted.for_each_ordered([&](size_t hash, int val) {
+        if (hash < prev || sorted.find_hashed(hash) == nullptr || *sorted.find_hashed(hash) != val) {
+            passed = false;
+        }
+        prev = hash;
+        ++ordered;
+    });
+
+    size_t common = 0;
+    size_t only = 0;
+    set_intersection(sorted, sorted, [&](size_t, int, int) { ++common; });
+    set_difference(sorted, lockfree::sorted_map<int>(), [&](size_t, int) { ++only; });
+
+    if (ordered != test.std_map.size() || common != ordered || only != ordered ||
+        sorted.find(std::string("not a key"), hash_str) != nullptr) {
+        passed = false;
+    }
+
+    std::cout << "Frozen entries: " << frozen.size() << " bits per entry: " << frozen.bits_per_entry() << std::endl;
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+}
+
+constexpr auto opcodes = lockfree::make_static_map<std::string_view, int>({
+    { "GET", 1 }, { "PUT", 2 }, { "POST", 3 }, { "DELETE", 4 }, { "HEAD", 5 },
+    { "OPTIONS", 6 }, { "PATCH", 7 }, { "TRACE", 8 }, { "CONNECT", 9 }
+});
+
+static_assert(*opcodes.find("PATCH") == 7);
+static_assert(opcodes.find("FETCH") == nullptr);
+
+void check_static_map() {
+    bool passed = true;
+    for (const auto& [ key, val ] : opcodes) {
+        const int* v = opcodes.find(std::string(key));
+        if (v == nullptr || *v != val) {
+            passed = false;
+        }
+    }
+    if (opcodes.find("") != nullptr || opcodes.find("get") != nullptr) {
+        passed = false;
+    }
+
+    std::cout << "Static map entries: " << opcodes.size() << std::endl;
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+}
+
+struct plain_counter_t {
+    size_t key;
+    int counter;
+
+    plain_counter_t(size_t key_) : key(key_), counter(0) {}
+};
+
+std::string temp_path(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("lockfree-test-" + std::to_string(::getpid()) + "-" + name)).string();
+}
+
+void check_snapshot() {
+    using map_t = lockfree::map<8192, size_t, plain_counter_t>;
+    map_t src;
+    map_t dst;
+
+    for (size_t i = 0; i < 5000; ++i) {
+        src.get(random(0, 1, 3000), hash_size_t, hash_size_t)->counter += 1;
+    }
+
+    std::string path = temp_path("snapshot");
+    auto written = lockfree::snapshot(src, path);
+    auto restored = lockfree::restore(dst, path, hash_size_t);
+
+    // A record count whose size in bytes wraps around is rejected, not read past the end.
+    bool count_checked = false;
+    {
+        lockfree::io::file raw(path, O_RDWR);
+        uint64_t count = UINT64_MAX / (sizeof(uint64_t) + sizeof(plain_counter_t)) + 1;
+        raw.pwrite_all(&count, sizeof(count), offsetof(lockfree::snapshot_header, count));
+        try {
+            map_t other;
+            lockfree::restore(other, path, hash_size_t);
+        } catch (std::runtime_error&) {
+            count_checked = true;
+        }
+    }
+    std::filesystem::remove(path);
+
+    std::map<size_t, int> src_counts;
+    std::map<size_t, int> dst_counts;
+    for (plain_counter_t& c : src) {
+        src_counts[c.key] = c.counter;
+    }
+    for (plain_counter_t& c : dst) {
+        dst_counts[c.key] = c.counter;
+    }
+
+    std::string mapped_path = temp_path("mapped");
+    lockfree::write_mapped(src, mapped_path);
+    lockfree::mapped_view<plain_counter_t> view(mapped_path);
+
+    bool mapped_ok = (view.size() == src_counts.size() && view.find(size_t(999999), hash_size_t, hash_size_t) == nullptr);
+    for (const auto& [ key, val ] : src_counts) {
+        const plain_counter_t* c = view.find(key, hash_size_t, hash_size_t);
+        if (c == nullptr || c->key != key || c->counter != val) {
+            mapped_ok = false;
+        }
+    }
+
+    // Corrupt copies are rejected with an error: a header without slots, slots past the
+    // records, records past the end, and a slot that points past the records.
+    std::string original;
+    {
+        std::ifstream in(mapped_path, std::ios::binary);
+        original.assign(std::istreambuf_iterator<char>(in), {});
+    }
+    auto rejects = [&](size_t at, uint64_t value, size_t key) {
+        std::string bytes = original;
+        std::memcpy(&bytes[at], &value, sizeof(value));
+        std::ofstream(mapped_path, std::ios::binary | std::ios::trunc) << bytes;
+        try {
+            lockfree::mapped_view<plain_counter_t> bad(mapped_path);
+            bad.find(key, hash_size_t, hash_size_t);
+        } catch (std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    lockfree::mapped_header header;
+    std::memcpy(&header, original.data(), sizeof(header));
+    size_t key = src_counts.begin()->first;
+    mapped_ok = mapped_ok && rejects(offsetof(lockfree::mapped_header, slots), 0, key);
+    mapped_ok = mapped_ok && rejects(offsetof(lockfree::mapped_header, slots), header.slots * 2, key);
+    mapped_ok = mapped_ok && rejects(offsetof(lockfree::mapped_header, records_offset), UINT64_MAX - 7, key);
+    mapped_ok = mapped_ok && rejects(offsetof(lockfree::mapped_header, count), UINT64_MAX / 2, key);
+    mapped_ok = mapped_ok && rejects(header.slots_offset + hash_size_t(key) % header.slots * sizeof(uint64_t), header.count + 1, key);
+    std::filesystem::remove(mapped_path);
+
+    std::cout << "Snapshot entries: " << written.entries << " bytes: " << written.bytes << " restored: " << restored.inserted
+              << " mapped: " << view.size() << std::endl;
+    std::cout << (src_counts == dst_counts && restored.inserted == written.entries && mapped_ok && count_checked ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_packed_snapshot() {
+    // Integers of every length, in a count that leaves a partial group.
+    std::vector<uint32_t> ints;
+    for (size_t i = 0; i < 1003; ++i) {
+        ints.push_back(uint32_t(hash_size_t(i)) >> (8 * (i % 4)));
+    }
+    std::vector<uint8_t> encoded(lockfree::varint::max_bytes(ints.size()));
+    size_t bytes = lockfree::varint::encode(ints.data(), ints.size(), encoded.data());
+    std::vector<uint32_t> decoded(ints.size());
+    size_t used = lockfree::varint::decode(encoded.data(), bytes, ints.size(), decoded.data());
+    bool ok = (used == bytes && decoded == ints);
+
+    // A block is only decoded from the bytes it is given.
+    {
+        std::vector<char> records(100 * (sizeof(uint64_t) + sizeof(uint32_t)));
+        for (size_t i = 0; i < 100; ++i) {
+            uint64_t hash = hash_size_t(i);
+            std::memcpy(&records[i * 12], &hash, sizeof(hash));
+        }
+        std::vector<char> block;
+        lockfree::packing::encode_block(records.data(), 100, sizeof(uint32_t), block);
+        std::vector<char> back(records.size());
+        ok = ok && lockfree::packing::decode_block(block.data(), block.size(), sizeof(uint32_t), back.data()) == block.size();
+        try {
+            lockfree::packing::decode_block(block.data(), block.size() - 1, sizeof(uint32_t), back.data());
+            ok = false;
+        } catch (std::runtime_error&) {}
+    }
+
+    using map_t = lockfree::map<8192, size_t, plain_counter_t>;
+    map_t src;
+    map_t dst;
+    for (size_t i = 0; i < 5000; ++i) {
+        src.get(random(0, 1, 3000), hash_size_t, hash_size_t)->counter += 1;
+    }
+
+    std::string path = temp_path("packed");
+    std::string raw_path = temp_path("raw");
+    auto raw = lockfree::snapshot(src, raw_path);
+    auto packed = lockfree::snapshot(src, path, lockfree::default_pool(), lockfree::snapshot_format::packed);
+    auto restored = lockfree::restore(dst, path, hash_size_t);
+
+    std::map<size_t, int> src_counts;
+    std::map<size_t, int> dst_counts;
+    for (plain_counter_t& c : src) {
+        src_counts[c.key] = c.counter;
+    }
+    for (plain_counter_t& c : dst) {
+        dst_counts[c.key] = c.counter;
+    }
+
+    // A cut-off packed snapshot is rejected.
+    std::filesystem::resize_file(path, packed.bytes - 1);
+    try {
+        map_t other;
+        lockfree::restore(other, path, hash_size_t);
+        ok = false;
+    } catch (std::runtime_error&) {}
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(raw_path);
+
+    std::cout << "Packed snapshot entries: " << packed.entries << " bytes: " << packed.bytes << " raw bytes: " << raw.bytes << std::endl;
+    std::cout << (ok && src_counts == dst_counts && restored.inserted == packed.entries && packed.bytes < raw.bytes ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_checkpoint() {
+    using map_t = lockfree::map<8192, size_t, plain_counter_t>;
+    map_t src;
+    map_t dst;
+    src.enable_dirty_tracking(256);
+    src.enable_erase();
+    dst.enable_erase();
+
+    for (size_t i = 0; i < 3000; ++i) {
+        src.get(random(0, 1, 3000), hash_size_t, hash_size_t)->counter += 1;
+    }
+
+    std::string base = temp_path("checkpoint-base");
+    std::vector<std::string> deltas = { temp_path("checkpoint-1"), temp_path("checkpoint-2") };
+    auto full = lockfree::checkpoint(src, base);
+
+    // A few updates and new keys per delta, so that only some regions are dirty.
+    std::vector<lockfree::snapshot_stats> written;
+    // Erased keys must stay erased after a restore, and keys erased and added again must come back.
+    size_t erased = 0;
+    for (const std::string& path : deltas) {
+        for (size_t i = 0; i < 20; ++i) {
+            src.update(random(0, 1, 4000), hash_size_t, hash_size_t, [](plain_counter_t& c) { c.counter += 100; });
+            erased += src.erase(random(0, 1, 3000), hash_size_t, hash_size_t);
+        }
+        src.get(size_t(1), hash_size_t, hash_size_t);
+        written.push_back(lockfree::checkpoint_incremental(src, path));
+        src.erase(size_t(1), hash_size_t, hash_size_t);
+    }
+    src.get(size_t(1), hash_size_t, hash_size_t);
+    written.push_back(lockfree::checkpoint_incremental(src, temp_path("checkpoint-3")));
+    deltas.push_back(temp_path("checkpoint-3"));
+
+    lockfree::restore_incremental(dst, base, deltas, hash_size_t);
+    std::filesystem::remove(base);
+    for (const std::string& path : deltas) {
+        std::filesystem::remove(path);
+    }
+
+    std::map<size_t, int> src_counts;
+    std::map<size_t, int> dst_counts;
+    for (plain_counter_t& c : src) {
+        src_counts[c.key] = c.counter;
+    }
+    for (plain_counter_t& c : dst) {
+        dst_counts[c.key] = c.counter;
+    }
+
+    bool smaller = written[0].entries > 0 && written[0].entries < full.entries && written[1].entries < full.entries;
+    bool clean = src.take_dirty().empty();
+
+    // Updates that race with the checkpoints are in the last delta at the latest.
+    {
+        map_t live;
+        map_t back;
+        live.enable_dirty_tracking(256);
+        std::string live_base = temp_path("checkpoint-live");
+        std::vector<std::string> live_deltas;
+        lockfree::checkpoint(live, live_base);
+
+        std::atomic<bool> done = false;
+        std::thread writer([&]() {
+            for (size_t i = 0; i < 200000; ++i) {
+                live.update(i % 100, hash_size_t, hash_size_t,
+                            [](plain_counter_t& c) { std::atomic_ref<int>(c.counter).fetch_add(1, std::memory_order_relaxed); });
+            }
+            done = true;
+        });
+        while (!done || live_deltas.size() < 3) {
+            live_deltas.push_back(temp_path("checkpoint-live-" + std::to_string(live_deltas.size())));
+            lockfree::checkpoint_incremental(live, live_deltas.back());
+        }
+        writer.join();
+        live_deltas.push_back(temp_path("checkpoint-live-" + std::to_string(live_deltas.size())));
+        lockfree::checkpoint_incremental(live, live_deltas.back());
+
+        lockfree::restore_incremental(back, live_base, live_deltas, hash_size_t);
+        std::filesystem::remove(live_base);
+        for (const std::string& path : live_deltas) {
+            std::filesystem::remove(path);
+        }
+        for (size_t i = 0; i < 100; ++i) {
+            plain_counter_t* c = back.find(i, hash_size_t, hash_size_t);
+            clean = clean && c != nullptr && c->counter == 2000;
+        }
+    }
+
+    std::cout << "Checkpoint entries: " << full.entries << " deltas: " << written[0].entries << " " << written[1].entries
+              << " erased: " << erased << std::endl;
+    std::cout << (src_counts == dst_counts && smaller && clean && erased > 0 ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_shm() {
+    using shm_t = lockfree::shm_map<8192, size_t, plain_counter_t>;
+    shm_t counters;
+
+    auto work = [&]() {
+        for (size_t i = 0; i < 2000; ++i) {
+            plain_counter_t* c = counters.get(i % 1000, hash_size_t, hash_size_t);
+            std::atomic_ref<int>(c->counter).fetch_add(1);
+        }
+    };
+
+    pid_t child = ::fork();
+    if (child == 0) {
+        work();
+        ::_exit(0);
+    }
+    work();
+    int status = 0;
+    ::waitpid(child, &status, 0);
+
+    bool ok = (WIFEXITED(status) && WEXITSTATUS(status) == 0 && counters.size() == 1000);
+    for (size_t i = 0; i < 1000; ++i) {
+        plain_counter_t* c = counters.find(i, hash_size_t, hash_size_t);
+        if (c == nullptr || c->key != i || c->counter != 4) {
+            ok = false;
+        }
+    }
+
+    // A second handle on the same name sees the same entries.
+    std::string name = "/lockfree-test-" + std::to_string(::getpid());
+    {
+        shm_t named(name);
+        shm_t attached(name);
+        named.get(42, hash_size_t, hash_size_t)->counter = 7;
+        plain_counter_t* c = attached.find(42, hash_size_t, hash_size_t);
+        ok = ok && c != nullptr && c->counter == 7 && attached.size() == 1;
+    }
+    shm_t::unlink(name);
+
+    std::cout << "Shared memory entries: " << counters.size() << std::endl;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_feed() {
+    using map_t = lockfree::map<8192, size_t, plain_counter_t>;
+    using feed_t = lockfree::change_feed<plain_counter_t>;
+
+    // A small ring with backpressure: every insert is delivered exactly once.
+    map_t m;
+    feed_t feed(64, feed_t::overflow::block);
+    feed.subscribe(m);
+
+    std::atomic<bool> done = false;
+    std::map<size_t, int> seen;
+    std::thread consumer([&]() {
+        auto take = [&](size_t hash, plain_counter_t* c) {
+            seen[c->key] += (hash == hash_size_t(c->key));
+        };
+        while (!done.load()) {
+            feed.poll(take);
+        }
+        feed.poll(take);
+    });
+
+    std::vector<std::thread> producers;
+    for (size_t t = 0; t < 4; ++t) {
+        producers.emplace_back([&]() {
+            for (size_t i = 0; i < 3000; ++i) {
+                m.get(i, hash_size_t, hash_size_t);
+            }
+        });
+    }
+    for (auto& t : producers) {
+        t.join();
+    }
+    done = true;
+    consumer.join();
+
+    bool exact = (seen.size() == 3000);
+    for (const auto& [ key, n ] : seen) {
+        exact = exact && (n == 1);
+    }
+
+    // Without a consumer, the events that don't fit are dropped and counted.
+    map_t other;
+    feed_t lossy(16);
+    lossy.subscribe(other);
+    for (size_t i = 0; i < 100; ++i) {
+        other.get(i, hash_size_t, hash_size_t);
+        other.get(i, hash_size_t, hash_size_t);
+    }
+    size_t kept = lossy.poll([](size_t, plain_counter_t*) {});
+
+    std::cout << "Feed delivered: " << seen.size() << " kept: " << kept << " dropped: " << lossy.dropped() << std::endl;
+    std::cout << (exact && feed.dropped() == 0 && kept == 16 && lossy.dropped() == 84 ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_wal() {
+    using map_t = lockfree::map<8192, size_t, plain_counter_t>;
+
+    struct record {
+        size_t key;
+        int total;
+    };
+
+    std::string log_path = temp_path("wal");
+    std::string snap_path = temp_path("wal-snapshot");
+    map_t src;
+    map_t dst;
+    size_t replayed = 0;
+    size_t rings_left = 0;
+
+    {
+        lockfree::wal<record> log(log_path, std::chrono::microseconds(200));
+
+        auto update = [&]() {
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < 4; ++t) {
+                threads.emplace_back([&]() {
+                    for (size_t i = 0; i < 2000; ++i) {
+                        size_t key = random(0, 1, 500);
+                        plain_counter_t* c = src.get(key, hash_size_t, hash_size_t);
+                        log.append({ key, std::atomic_ref<int>(c->counter).fetch_add(1) + 1 });
+                    }
+                    log.sync();
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+        };
+
+        update();
+        size_t mark = log.flush();
+        // The rings of the threads that exited are gone after the flush.
+        rings_left = log.rings();
+        lockfree::snapshot(src, snap_path);
+        log.truncate(mark);
+        update();
+    }
+
+    // Recovery: the snapshot, then the log replayed with max() on the totals.
+    lockfree::restore(dst, snap_path, hash_size_t);
+    replayed = lockfree::wal<record>::replay(log_path, [&](const record& r) {
+        plain_counter_t* c = dst.get(r.key, hash_size_t, hash_size_t);
+        c->counter = std::max(c->counter, r.total);
+    });
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(snap_path);
+
+    std::map<size_t, int> src_counts;
+    std::map<size_t, int> dst_counts;
+    for (plain_counter_t& c : src) {
+        src_counts[c.key] = c.counter;
+    }
+    for (plain_counter_t& c : dst) {
+        dst_counts[c.key] = c.counter;
+    }
+
+    // One thread writing to one log after another, each dropped before the next one.
+    size_t sequential = 0;
+    for (size_t n = 0; n < 20; ++n) {
+        lockfree::wal<record> log(log_path, std::chrono::microseconds(200));
+        log.append({ n, 1 });
+        log.sync();
+        sequential += log.rings();
+    }
+    std::filesystem::remove(log_path);
+
+    std::cout << "WAL replayed: " << replayed << " keys: " << dst_counts.size() << std::endl;
+    std::cout << (replayed == 8000 && src_counts == dst_counts && rings_left == 0 && sequential == 20 ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_replica() {
+    using map_t = lockfree::map<8192, size_t, plain_counter_t>;
+
+    struct record {
+        size_t key;
+        int total;
+    };
+
+    std::string log_path = temp_path("replica-wal");
+    map_t src;
+    map_t replica;
+    bool ok = true;
+
+    {
+        lockfree::wal<record> log(log_path, std::chrono::microseconds(200));
+        lockfree::wal_follower<record> follower(log_path);
+
+        auto apply = [&](const record* r, size_t n) {
+            replica.bulk_emplace(n,
+                                 [&](size_t i) { return hash_size_t(r[i].key); },
+                                 [&](size_t i) {
+                                     plain_counter_t c(r[i].key);
+                                     c.counter = r[i].total;
+                                     return c;
+                                 },
+                                 [&](plain_counter_t& c, size_t i) { c.counter = std::max(c.counter, r[i].total); },
+                                 hash_size_t, lockfree::inline_executor());
+        };
+
+        auto update = [&]() {
+            for (size_t i = 0; i < 3000; ++i) {
+                size_t key = random(0, 1, 700);
+                plain_counter_t* c = src.get(key, hash_size_t, hash_size_t);
+                log.append({ key, ++c->counter });
+                if (i % 500 == 0) {
+                    follower.poll(apply);
+                }
+            }
+            uint64_t mark = log.flush();
+            while (follower.applied() < mark) {
+                follower.poll(apply);
+            }
+            return mark;
+        };
+
+        uint64_t mark = update();
+        ok = ok && follower.lag().bytes == 0;
+
+        // The follower moves over to the truncated log at the same position.
+        log.truncate(mark);
+        update();
+    }
+    std::filesystem::remove(log_path);
+
+    std::map<size_t, int> src_counts;
+    std::map<size_t, int> replica_counts;
+    for (plain_counter_t& c : src) {
+        src_counts[c.key] = c.counter;
+    }
+    for (plain_counter_t& c : replica) {
+        replica_counts[c.key] = c.counter;
+    }
+
+    std::cout << "Replica keys: " << replica_counts.size() << std::endl;
+    std::cout << (ok && src_counts == replica_counts ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_erase() {
+    // A small table with long probe chains, so that erased slots sit in the chains of other keys.
+    lockfree::map<512, size_t, plain_counter_t> m;
+    m.enable_erase();
+
+    for (size_t i = 0; i < 400; ++i) {
+        m.get(i, hash_size_t, hash_size_t)->counter = i;
+    }
+
+    size_t erased = 0;
+    for (size_t i = 0; i < 400; i += 2) {
+        erased += m.erase(i, hash_size_t, hash_size_t);
+    }
+    bool twice = m.erase(0, hash_size_t, hash_size_t);
+
+    bool ok = (erased == 200 && !twice);
+
+    // Maps without erase support keep single compare-and-swap inserts and refuse to erase.
+    lockfree::map<512, size_t, plain_counter_t> fixed;
+    fixed.get(size_t(1), hash_size_t, hash_size_t);
+    try {
+        fixed.erase(size_t(1), hash_size_t, hash_size_t);
+        ok = false;
+    } catch (std::runtime_error&) {}
+    ok = ok && fixed.find(size_t(1), hash_size_t, hash_size_t) != nullptr;
+    for (size_t i = 0; i < 400; ++i) {
+        plain_counter_t* c = m.find(i, hash_size_t, hash_size_t);
+        ok = ok && ((i % 2 == 0) ? c == nullptr : (c != nullptr && c->counter == (int)i));
+    }
+
+    size_t live = 0;
+    for (plain_counter_t& c : m) {
+        ok = ok && (c.key % 2 == 1);
+        ++live;
+    }
+
+    // Erased keys come back with a fresh value.
+    for (size_t i = 0; i < 400; i += 4) {
+        plain_counter_t* c = m.get(i, hash_size_t, hash_size_t);
+        ok = ok && c != nullptr && c->counter == 0;
+    }
+
+    // A mapped view probes past the ghosts like the map does.
+    std::string mapped_path = temp_path("erase-mapped");
+    lockfree::write_mapped(m, mapped_path);
+    {
+        lockfree::mapped_view<plain_counter_t> view(mapped_path);
+        for (size_t i = 0; i < 400; ++i) {
+            const plain_counter_t* c = view.find(i, hash_size_t, hash_size_t);
+            ok = ok && ((i % 4 == 2) ? c == nullptr : (c != nullptr && c->key == i));
+        }
+    }
+    std::filesystem::remove(mapped_path);
+    size_t reclaimed = m.reclaim();
+
+    // Many more distinct keys than slots pass through a small table, 500 at a time.
+    lockfree::map<1024, size_t, plain_counter_t> churn;
+    churn.enable_erase();
+    size_t failed = 0;
+    for (size_t i = 0; i < 5000; ++i) {
+        failed += (churn.get(10000 + i, hash_size_t, hash_size_t) == nullptr);
+        if (i >= 500) {
+            churn.erase(10000 + i - 500, hash_size_t, hash_size_t);
+        }
+    }
+    ok = ok && failed == 0;
+
+    // Threads churn keys of their own while they race to insert the same new keys into ghosts:
+    // every raced key must end up in one slot, with the increments of all threads.
+    lockfree::map<4096, std::string, counter_t> shared;
+    shared.enable_erase();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t n = 0; n < 2000; ++n) {
+                shared.get("own-" + std::to_string(t) + "-" + std::to_string(n), hash_str, hash_size_t);
+                if (n >= 100) {
+                    shared.erase("own-" + std::to_string(t) + "-" + std::to_string(n - 100), hash_str, hash_size_t);
+                }
+                if (counter_t* c = shared.get("race-" + std::to_string(n), hash_str, hash_size_t)) {
+                    c->counter += 1;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::map<std::string, int> copies;
+    for (counter_t& c : shared) {
+        copies[c.key] += 1;
+        ok = ok && (c.key.starts_with("own-") || c.counter == 4);
+    }
+    size_t raced = 0;
+    for (const auto& [ key, n ] : copies) {
+        ok = ok && n == 1;
+        raced += key.starts_with("race-");
+    }
+    ok = ok && raced == 2000 && copies.size() == 2000 + 4 * 100;
+
+    std::cout << "Erased: " << erased << " live: " << live << " reclaimed: " << reclaimed << " churn failures: " << failed
+              << " raced keys: " << raced << std::endl;
+    std::cout << (ok && live == 200 && reclaimed == 200 ? "PASSED" : "FAILED") << std::endl;
+}
+
+/* Runs everything in the calling thread, after calling hook: stands in for work that races with a bulk operation. */
+struct hooked_executor {
+    std::function<void()> hook;
+
+    size_t concurrency() const {
+        return 1;
+    }
+
+    void parallel_for(size_t n, auto&& fn) {
+        hook();
+        for (size_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+    }
+};
+
+void check_tiered() {
+    using tiered_t = lockfree::tiered_map<4096, 8192, size_t, plain_counter_t>;
+
+    std::string path = temp_path("tiered");
+    auto t = std::make_unique<tiered_t>(path);
+    std::map<size_t, int> expected;
+
+    for (size_t i = 0; i < 1000; ++i) {
+        t->get(i, hash_size_t, hash_size_t)->counter += 1;
+        expected[i] += 1;
+    }
+
+    // Everything was touched in the first round; the second round demotes what was not touched since.
+    size_t first = t->demote_cold(hash_size_t);
+    for (size_t i = 0; i < 100; ++i) {
+        t->get(i, hash_size_t, hash_size_t)->counter += 1;
+        expected[i] += 1;
+    }
+    size_t second = t->demote_cold(hash_size_t);
+    t->reclaim();
+
+    size_t hot = t->stats().hot;
+
+    // Cold entries are promoted on access, with their values.
+    for (size_t i = 0; i < 1000; i += 3) {
+        t->get(i, hash_size_t, hash_size_t)->counter += 1;
+        expected[i] += 1;
+    }
+
+    // Hashes share touched bits, so a few untouched entries can stay hot.
+    bool ok = (first == 0 && second + hot == 1000 && second >= 850);
+    for (const auto& [ key, val ] : expected) {
+        plain_counter_t* c = t->find(key, hash_size_t, hash_size_t);
+        ok = ok && c != nullptr && c->key == key && c->counter == val;
+    }
+    ok = ok && t->find(size_t(5000), hash_size_t, hash_size_t) == nullptr;
+
+    auto stats = t->stats();
+    t.reset();
+    std::filesystem::remove(path);
+
+    // A touch made while demote_cold() runs keeps the entry hot for the next round as well.
+    {
+        auto raced = std::make_unique<tiered_t>(path);
+        for (size_t i = 0; i < 100; ++i) {
+            raced->get(i, hash_size_t, hash_size_t);
+        }
+        hooked_executor during{ [&]() { raced->get(size_t(7), hash_size_t, hash_size_t); } };
+        raced->demote_cold(hash_size_t, during);
+        raced->demote_cold(hash_size_t);
+        ok = ok && raced->stats().hot >= 1 && raced->stats().demoted >= 90;
+        raced->demote_cold(hash_size_t);
+        ok = ok && raced->stats().hot == 0;
+        raced.reset();
+        std::filesystem::remove(path);
+    }
+
+    // A long tail of distinct keys: demoted entries leave ghosts that new keys take over.
+    {
+        auto small = std::make_unique<lockfree::tiered_map<1024, 1 << 16, size_t, plain_counter_t>>(path);
+        size_t failed = 0;
+        for (size_t round = 0; round < 10; ++round) {
+            for (size_t i = 0; i < 400; ++i) {
+                failed += (small->get(round * 400 + i, hash_size_t, hash_size_t) == nullptr);
+            }
+            small->demote_cold(hash_size_t);
+            small->demote_cold(hash_size_t);
+            small->reclaim();
+        }
+        ok = ok && failed == 0 && small->stats().hot == 0 && small->find(size_t(7), hash_size_t, hash_size_t) != nullptr;
+        small.reset();
+        std::filesystem::remove(path);
+    }
+
+    std::cout << "Tiered demoted: " << second << " hot: " << hot << " promoted: " << stats.promoted << std::endl;
+    std::cout << (ok && stats.hot == 1000 ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_file_map() {
+    using file_map_t = lockfree::file_map<size_t, plain_counter_t>;
+
+    std::string path = temp_path("file-map");
+    bool ok = true;
+    {
+        // Enough keys to overflow some buckets, counted by several threads.
+        file_map_t m(path, 20000);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 4; ++t) {
+            threads.emplace_back([&]() {
+                for (size_t i = 0; i < 20000; ++i) {
+                    plain_counter_t* c = m.get(i, hash_size_t, hash_size_t);
+                    std::atomic_ref<int>(c->counter).fetch_add(1);
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        m.flush();
+        ok = ok && m.size() == 20000;
+    }
+
+    // Opening the file again finds the same entries; the capacity argument is ignored.
+    size_t entries = 0;
+    {
+        file_map_t m(path, 1);
+        entries = m.size();
+        for (size_t i = 0; i < 20000; ++i) {
+            plain_counter_t* c = m.find(i, hash_size_t, hash_size_t);
+            ok = ok && c != nullptr && c->key == i && c->counter == 4;
+        }
+        ok = ok && m.find(size_t(20000), hash_size_t, hash_size_t) == nullptr;
+    }
+
+    // A different value type does not fit the layout.
+    try {
+        lockfree::file_map<size_t, size_t> wrong(path, 1);
+        ok = false;
+    } catch (std::runtime_error&) {}
+
+    // A writer that died while filling in an entry left it busy: the entry is freed by the next
+    // open that has the file to itself, and only then.
+    size_t reclaimed = 0;
+    {
+        uint64_t busy_key = 12345;
+        uint64_t stored = hash_size_t(busy_key);
+        uint64_t busy = 1;
+        lockfree::io::file raw(path, O_RDWR);
+        lockfree::io::mapping bytes(raw);
+        for (size_t at = 0; at + sizeof(uint64_t) <= bytes.size; at += sizeof(uint64_t)) {
+            if (std::memcmp(bytes.data + at, &stored, sizeof(stored)) == 0) {
+                raw.pwrite_all(&busy, sizeof(busy), at);
+            }
+        }
+
+        file_map_t first(path, 1);
+        reclaimed = first.reclaimed_entries();
+        ok = ok && first.find(size_t(12345), hash_size_t, hash_size_t) == nullptr;
+        ok = ok && first.get(size_t(12345), hash_size_t, hash_size_t)->counter == 0;
+
+        raw.pwrite_all(&busy, sizeof(busy), bytes.size - 4096);
+        file_map_t second(path, 1);
+        ok = ok && second.reclaimed_entries() == 0;
+    }
+
+    std::filesystem::remove(path);
+
+    // Threads creating the same file with different capacities all get the first one's table.
+    {
+        std::vector<size_t> sizes(4);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 4; ++t) {
+            threads.emplace_back([&, t]() {
+                file_map_t m(path, 1000 * (t + 1));
+                m.get(t, hash_size_t, hash_size_t);
+                sizes[t] = m.bytes();
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        file_map_t m(path, 1);
+        ok = ok && std::count(sizes.begin(), sizes.end(), sizes[0]) == 4 && m.size() == 4;
+    }
+
+    // A file that is not empty is never taken for a new one, and the header must fit the file.
+    {
+        lockfree::io::file raw(path, O_RDWR);
+        auto rejected = [&]() {
+            try {
+                file_map_t m(path, 1);
+            } catch (std::runtime_error&) {
+                return true;
+            }
+            return false;
+        };
+        std::vector<char> zeros(4096);
+        raw.pwrite_all(zeros.data(), zeros.size(), 0);
+        ok = ok && rejected();
+
+        lockfree::file_map_header header;
+        header.entry_size = sizeof(uint64_t) + sizeof(plain_counter_t);
+        header.page_size = 4096;
+        header.buckets = 1000;
+        raw.pwrite_all(&header, sizeof(header), 0);
+        ok = ok && rejected();
+        header.buckets = 0;
+        raw.pwrite_all(&header, sizeof(header), 0);
+        ok = ok && rejected();
+    }
+    std::filesystem::remove(path);
+
+    std::cout << "File map entries: " << entries << " reclaimed: " << reclaimed << std::endl;
+    std::cout << (ok && entries == 20000 && reclaimed == 1 ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_group_by() {
+    using lockfree::agg;
+    lockfree::group_by<4096, size_t, int64_t, agg::sum, agg::count, agg::min, agg::max, agg::avg> g;
+
+    // More rows than one morsel, so that several workers aggregate into the same groups.
+    std::vector<size_t> keys;
+    std::vector<int64_t> values;
+    for (size_t i = 0; i < 100000; ++i) {
+        keys.push_back(random(0, 1, 1000));
+        values.push_back(random(0, -5000, 5000));
+    }
+
+    struct expected_t {
+        int64_t sum = 0;
+        uint64_t count = 0;
+        int64_t min = INT64_MAX;
+        int64_t max = INT64_MIN;
+    };
+    std::map<size_t, expected_t> expected;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        expected_t& e = expected[keys[i]];
+        e.sum += values[i];
+        e.count += 1;
+        e.min = std::min(e.min, values[i]);
+        e.max = std::max(e.max, values[i]);
+    }
+
+    lockfree::work_stealing_pool pool(4);
+    size_t dropped = g.consume(keys.data(), values.data(), keys.size(), hash_size_t, hash_size_t, pool);
+
+    bool ok = (dropped == 0);
+    size_t groups = 0;
+    g.for_each([&](size_t key, uint64_t rows, const auto& r) {
+        const expected_t& e = expected[key];
+        auto [ sum, count, min, max, avg ] = r;
+        static_assert(std::is_same_v<decltype(sum), int64_t> && std::is_same_v<decltype(count), uint64_t> &&
+                      std::is_same_v<decltype(avg), double>);
+        ok = ok && rows == e.count && sum == e.sum && count == e.count && min == e.min && max == e.max &&
+             avg == double(e.sum) / e.count;
+        ++groups;
+    });
+
+    // Integer results past 2^53 are exact.
+    lockfree::group_by<64, size_t, uint64_t, agg::sum, agg::max> big;
+    std::vector<size_t> big_keys = { 1, 1, 1 };
+    std::vector<uint64_t> big_values = { (uint64_t(1) << 62) + 1, (uint64_t(1) << 60) + 3, UINT64_MAX - (uint64_t(1) << 63) };
+    big.consume(big_keys.data(), big_values.data(), big_keys.size(), hash_size_t, hash_size_t, pool);
+    auto [ big_sum, big_max ] = big.find(size_t(1), hash_size_t, hash_size_t)->results();
+    ok = ok && big_sum == big_values[0] + big_values[1] + big_values[2] && big_max == big_values[2];
+
+    std::cout << "Groups: " << groups << " expected: " << expected.size() << std::endl;
+    std::cout << (ok && groups == expected.size() ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_join() {
+    using join_t = lockfree::hash_join<4096, size_t, int>;
+
+    // Build keys 0..999 with up to three rows each; probe keys 0..1999, some of them twice.
+    std::vector<size_t> build_keys;
+    std::vector<int> build_rows;
+    std::multimap<size_t, int> expected_rows;
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t key = random(0, 0, 999);
+        build_keys.push_back(key);
+        build_rows.push_back(i);
+        expected_rows.emplace(key, i);
+    }
+    std::vector<size_t> probe_keys;
+    for (size_t i = 0; i < 40000; ++i) {
+        probe_keys.push_back(random(0, 0, 1999));
+    }
+
+    join_t join;
+    lockfree::work_stealing_pool pool(4);
+    auto stats = join.build(build_keys.data(), build_rows.data(), build_keys.size(), hash_size_t, hash_size_t, pool);
+
+    auto collect = [&](lockfree::join_mode mode) {
+        std::multiset<std::pair<size_t, int>> ret;
+        for (const auto& part : join.probe(probe_keys.data(), probe_keys.size(), hash_size_t, hash_size_t, pool, mode)) {
+            for (auto [ probe, build ] : part) {
+                ret.emplace(probe, build == join_t::NO_MATCH ? -1 : join.row(build));
+            }
+        }
+        return ret;
+    };
+
+    std::multiset<std::pair<size_t, int>> inner;
+    std::multiset<size_t> semi;
+    std::multiset<size_t> anti;
+    for (size_t p = 0; p < probe_keys.size(); ++p) {
+        auto [ lo, hi ] = expected_rows.equal_range(probe_keys[p]);
+        for (auto i = lo; i != hi; ++i) {
+            inner.emplace(p, i->second);
+        }
+        (lo == hi ? anti : semi).insert(p);
+    }
+
+    auto got_inner = collect(lockfree::join_mode::inner);
+    bool ok = (stats.failed == 0 && got_inner == inner);
+
+    std::multiset<size_t> got_semi;
+    for (auto [ probe, row ] : collect(lockfree::join_mode::semi)) {
+        ok = ok && build_keys[row] == probe_keys[probe];
+        got_semi.insert(probe);
+    }
+    std::multiset<size_t> got_anti;
+    for (auto [ probe, row ] : collect(lockfree::join_mode::anti)) {
+        ok = ok && row == -1;
+        got_anti.insert(probe);
+    }
+
+    std::cout << "Join pairs: " << got_inner.size() << " semi: " << got_semi.size() << " anti: " << got_anti.size() << std::endl;
+    std::cout << (ok && got_semi == semi && got_anti == anti ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_dedup() {
+    bool ok = true;
+    size_t news = 0;
+
+    for (size_t bloom_bits : { size_t(0), size_t(1) << 16 }) {
+        lockfree::dedup_filter<1 << 16> seen(2, bloom_bits);
+
+        // Every id is fed by four threads at once; exactly one of them sees it first.
+        std::atomic<size_t> first = 0;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 4; ++t) {
+            threads.emplace_back([&]() {
+                for (size_t id = 0; id < 20000; ++id) {
+                    first += seen.first_seen(hash_size_t(id), hash_size_t);
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        ok = ok && first == 20000 && seen.overflowed() == 0;
+        news += first;
+
+        // Ids of the previous generation are still known, older ones are forgotten.
+        seen.advance();
+        size_t again = 0;
+        for (size_t id = 0; id < 20000; ++id) {
+            again += seen.first_seen(hash_size_t(id), hash_size_t);
+        }
+        seen.advance();
+        seen.advance();
+        size_t forgotten = 0;
+        for (size_t id = 0; id < 20000; ++id) {
+            forgotten += seen.first_seen(hash_size_t(id), hash_size_t);
+        }
+        ok = ok && again == 0 && forgotten == 20000;
+    }
+
+    std::cout << "Dedup first seen: " << news << std::endl;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_interner() {
+    lockfree::interner<16384> labels;
+    auto hash_sv = [](std::string_view s) { return hash(s.data(), s.size()); };
+
+    // Four threads intern the same 5000 labels in different orders.
+    std::vector<std::vector<lockfree::interner<16384>::interned>> got(4, std::vector<lockfree::interner<16384>::interned>(5000));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t n = 0; n < 5000; ++n) {
+                size_t i = (t % 2 ? 4999 - n : n);
+                std::string label = "label-" + std::to_string(i);
+                got[t][i] = labels.intern(label, hash_sv, hash_size_t);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::vector<int> ids_seen(5000);
+    bool ok = (labels.size() == 5000);
+    for (size_t i = 0; i < 5000; ++i) {
+        std::string label = "label-" + std::to_string(i);
+        for (size_t t = 0; t < 4; ++t) {
+            ok = ok && got[t][i].id == got[0][i].id && got[t][i].text.data() == got[0][i].text.data();
+        }
+        ok = ok && got[0][i].id < 5000 && got[0][i].text == label && labels.lookup(got[0][i].id) == label;
+        ids_seen[got[0][i].id % 5000] += 1;
+    }
+    ok = ok && std::count(ids_seen.begin(), ids_seen.end(), 1) == 5000;
+    ok = ok && !labels.find("not a label", hash_sv, hash_size_t);
+
+    // A hash that only looks at the length: every string of the same length collides.
+    lockfree::interner<1024> colliding;
+    auto by_length = [](std::string_view s) { return s.size(); };
+    uint32_t a = colliding.intern("abc", by_length, hash_size_t).id;
+    uint32_t b = colliding.intern("xyz", by_length, hash_size_t).id;
+    uint32_t c = colliding.intern("abc", by_length, hash_size_t).id;
+    ok = ok && a == c && a != b && colliding.lookup(b) == "xyz" && colliding.find("xyz", by_length, hash_size_t)->id == b;
+
+    // One thread interning into one interner after another, each destroyed before the next one.
+    for (size_t n = 0; n < 20; ++n) {
+        auto fresh = std::make_unique<lockfree::interner<1024>>();
+        ok = ok && fresh->intern("label-" + std::to_string(n), hash_sv, hash_size_t).id == 0;
+        ok = ok && fresh->intern("other", hash_sv, hash_size_t).id == 1;
+    }
+
+    std::cout << "Interned: " << labels.size() << " arena bytes: " << labels.arena_bytes() << std::endl;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+}
+
+void check_top_k() {
+    lockfree::map<16384, std::string, counter_t> counts;
+    std::vector<std::pair<int, std::string>> expected;
+
+    // Distinct counts, in a scrambled order, plus a block of equal ones below the top.
+    for (int i = 0; i < 5000; ++i) {
+        std::string key = std::to_string((i * 7919) % 5000);
+        int n = (i < 4000 ? (i * 7919) % 5000 : 1);
+        counts.get(key, hash_str, hash_size_t)->counter = n;
+        expected.emplace_back(n, key);
+    }
+    std::sort(expected.begin(), expected.end(), std::greater<>());
+
+    lockfree::work_stealing_pool pool(4);
+    auto score = [](counter_t& c) { return c.counter.load(); };
+    auto top = counts.top_k(pool, 100, score);
+
+    bool ok = (top.size() == 100);
+    for (size_t i = 0; ok && i < top.size(); ++i) {
+        ok = top[i]->counter == expected[i].first && top[i]->key == expected[i].second;
+    }
+
+    // Asking for more than there is returns everything, sorted; asking for nothing returns nothing.
+    auto all = counts.top_k(pool, 10000, score);
+    ok = ok && all.size() == 5000 && counts.top_k(pool, 0, score).empty();
+    for (size_t i = 1; ok && i < all.size(); ++i) {
+        ok = all[i - 1]->counter >= all[i]->counter;
+    }
+
+    std::cout << "Top: " << (top.empty() ? 0 : top[0]->counter.load()) << " 100th: " << (top.size() < 100 ? 0 : top[99]->counter.load())
+              << std::endl;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+}
+
 int main(int argc, char** argv) {
 
     try {
         Test test;
         go(test);
         check(test);
+        check_transform_reduce(test);
+        check_frozen(test);
+        check_static_map();
+        check_pool();
+        check_bulk();
+        check_merge();
+        check_snapshot();
+        check_packed_snapshot();
+        check_checkpoint();
+        check_shm();
+        check_feed();
+        check_wal();
+        check_replica();
+        check_erase();
+        check_tiered();
+        check_file_map();
+        check_group_by();
+        check_join();
+        check_dedup();
+        check_interner();
+        check_top_k();
         
     } catch (std::exception& e) {
         std::cout << "ERROR: " << e.what() << std::endl;
@@ -0,0 +1,292 @@
+#include "lockfree-map.hh"
+#include "lockfree-executor.hh"
+#include "lockfree-snapshot.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Counts the words of a text file with the lockfree map and prints the most frequent ones.
+ * Run `./wordcount <file> [n]`; the top n words (20 by default) go to stdout, statistics to stderr.
+ *
+ * A word is a run of bytes above ' ', so that delimiters are found with one SIMD compare per
+ * block. The file is mapped and cut into chunks at newlines, one task per chunk on the
+ * work-stealing pool. Every task adds its counts to a small table of its own first and only
+ * sends a word's count to the shared map when the word is evicted from that table or the chunk
+ * ends, so that frequent words do not make every core update the same counter. Evicted counts
+ * are sent in batches, with the map's slots and elements for the batch prefetched first.
+ */
+
+constexpr size_t SLOTS = size_t(1) << 24;
+
+uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+uint64_t hash_word(std::string_view w) {
+    uint64_t h = 0x9e3779b97f4a7c15 ^ w.size();
+    size_t i = 0;
+    for (; i + 8 <= w.size(); i += 8) {
+        uint64_t v;
+        std::memcpy(&v, w.data() + i, 8);
+        h = mix(h ^ v);
+    }
+    if (i < w.size()) {
+        uint64_t v = 0;
+        std::memcpy(&v, w.data() + i, w.size() - i);
+        h = mix(h ^ v);
+    }
+    return h;
+}
+
+uint64_t hash_next(size_t prev) {
+    return mix(prev + 0x9e3779b97f4a7c15);
+}
+
+struct word_count {
+    // Points into the mapped file.
+    std::string_view word;
+    std::atomic<uint64_t> count = 0;
+
+    word_count(std::string_view word_) : word(word_) {}
+};
+
+using map_t = lockfree::map<SLOTS, std::string_view, word_count>;
+
+/* Orders words by count, then the other way by word: the highest rank is the most frequent, first in alphabetical order. */
+struct rank {
+    uint64_t count;
+    std::string_view word;
+
+    bool operator<(const rank& other) const {
+        return count < other.count || (count == other.count && other.word < word);
+    }
+};
+
+/* Bit i is set when p[i] is a delimiter, for the 64 bytes at p. */
+uint64_t delimiters(const char* p) {
+#if defined(__AVX2__)
+    __m256i space = _mm256_set1_epi8(' ');
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+    // x <= ' ' as unsigned bytes: min(x, ' ') == x.
+    uint32_t a = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(lo, space), lo));
+    uint32_t b = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(hi, space), hi));
+    return a | (uint64_t(b) << 32);
+#elif defined(__SSE2__)
+    __m128i space = _mm_set1_epi8(' ');
+    uint64_t ret = 0;
+    for (size_t k = 0; k < 4; ++k) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(p + 16 * k));
+        ret |= uint64_t((uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, space), x))) << (16 * k);
+    }
+    return ret;
+#else
+    uint64_t ret = 0;
+    for (size_t i = 0; i < 64; ++i) {
+        ret |= uint64_t((unsigned char)p[i] <= ' ') << i;
+    }
+    return ret;
+#endif
+}
+
+/* Calls fn(word) for every word in [p, end); words end at a delimiter or at end. */
+void for_each_word(const char* p, const char* end, auto&& fn) {
+    const char* start = nullptr;
+
+    for (const char* block = p; block < end; block += 64) {
+        uint64_t mask;
+        size_t n = std::min<size_t>(64, end - block);
+
+        if (n == 64) {
+            mask = delimiters(block);
+        } else {
+            // The tail counts as delimiters past the end.
+            mask = ~uint64_t(0) << n;
+            for (size_t i = 0; i < n; ++i) {
+                mask |= uint64_t((unsigned char)block[i] <= ' ') << i;
+            }
+        }
+
+        size_t pos = 0;
+        while (pos < 64) {
+            if (start == nullptr) {
+                // Skip delimiters.
+                uint64_t words = ~mask >> pos;
+                if (words == 0) {
+                    break;
+                }
+                pos += std::countr_zero(words);
+                start = block + pos;
+            } else {
+                uint64_t delims = mask >> pos;
+                if (delims == 0) {
+                    break;
+                }
+                pos += std::countr_zero(delims);
+                fn(std::string_view(start, block + pos - start));
+                start = nullptr;
+            }
+        }
+    }
+
+    if (start != nullptr) {
+        fn(std::string_view(start, end - start));
+    }
+}
+
+struct totals {
+    std::atomic<size_t> words = 0;
+    std::atomic<size_t> dropped = 0;
+};
+
+/* Adds n occurrences of word; words whose hash is taken by another word move on to a derived hash. */
+void add(map_t& counts, std::string_view word, uint64_t hash, uint64_t n, totals& total) {
+    for (size_t round = 0; round < 8; ++round, hash = hash_next(hash ^ 0x5bd1e995)) {
+        word_count* c = counts.emplace_hashed(hash, hash_next, 32, word).first;
+        if (c == nullptr) {
+            break;
+        }
+        if (c->word == word) {
+            c->count.fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+    }
+    total.dropped.fetch_add(n, std::memory_order_relaxed);
+}
+
+/* Counts one chunk, combining the counts of recent words locally first. */
+void count_chunk(map_t& counts, const char* p, const char* end, totals& total) {
+    struct pending {
+        std::string_view word;
+        uint64_t hash = 0;
+        uint64_t n = 0;
+    };
+    constexpr size_t CACHE = 16384;
+    constexpr size_t BATCH = 32;
+
+    std::vector<pending> cache(CACHE);
+    std::vector<pending> evicted;
+    evicted.reserve(BATCH);
+    size_t words = 0;
+
+    // Evicted counts go to the map in batches, with the misses of a batch overlapped by prefetching.
+    auto flush = [&]() {
+        for (const pending& e : evicted) {
+            counts.prefetch(e.hash);
+        }
+        for (const pending& e : evicted) {
+            counts.prefetch_value(e.hash);
+        }
+        for (const pending& e : evicted) {
+            add(counts, e.word, e.hash, e.n, total);
+        }
+        evicted.clear();
+    };
+
+    for_each_word(p, end, [&](std::string_view w) {
+        ++words;
+        uint64_t hash = hash_word(w);
+        pending& slot = cache[hash % CACHE];
+
+        if (slot.n > 0 && slot.hash == hash && slot.word == w) {
+            ++slot.n;
+            return;
+        }
+        if (slot.n > 0) {
+            evicted.push_back(slot);
+            if (evicted.size() == BATCH) {
+                flush();
+            }
+        }
+        slot = { w, hash, 1 };
+    });
+
+    for (const pending& slot : cache) {
+        if (slot.n > 0) {
+            evicted.push_back(slot);
+            if (evicted.size() == BATCH) {
+                flush();
+            }
+        }
+    }
+    flush();
+    total.words.fetch_add(words, std::memory_order_relaxed);
+}
+
+int main(int argc, char** argv) {
+
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <file> [n]" << std::endl;
+        return 1;
+    }
+    size_t top = (argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 20);
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+
+        lockfree::io::file f(argv[1], O_RDONLY);
+        lockfree::io::mapping data(f);
+        ::madvise(data.data, data.size, MADV_SEQUENTIAL);
+
+        auto& pool = lockfree::default_pool();
+        auto counts = std::make_unique<map_t>();
+        totals total;
+
+        // Chunk boundaries are moved forward to just after a newline, so no word is cut.
+        size_t chunks = std::max<size_t>(std::min<size_t>(pool.concurrency() * 16, data.size / (1 << 16)), 1);
+        std::vector<size_t> bounds(chunks + 1, data.size);
+        bounds[0] = 0;
+        for (size_t c = 1; c < chunks; ++c) {
+            size_t at = std::max(data.size / chunks * c, bounds[c - 1]);
+            const void* nl = (at < data.size ? std::memchr(data.data + at, '\n', data.size - at) : nullptr);
+            bounds[c] = (nl ? (const char*)nl - data.data + 1 : data.size);
+        }
+
+        pool.parallel_for(chunks, [&](size_t c) {
+            count_chunk(*counts, data.data + bounds[c], data.data + bounds[c + 1], total);
+        });
+
+        // Equal counts are ranked by word, so the cut and the order are the same on every run.
+        auto best = counts->top_k(pool, top, [](word_count& w) { return rank{ w.count.load(std::memory_order_relaxed), w.word }; });
+        std::vector<std::pair<uint64_t, std::string_view>> words;
+        for (word_count* w : best) {
+            words.emplace_back(w->count.load(std::memory_order_relaxed), w->word);
+        }
+        size_t distinct = counts->transform_reduce(pool, size_t(0), std::plus<size_t>(), [](word_count&) { return size_t(1); });
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        for (size_t i = 0; i < words.size(); ++i) {
+            std::cout << words[i].first << "\t" << words[i].second << "\n";
+        }
+        std::cout.flush();
+
+        std::cerr << "bytes: " << data.size << " words: " << total.words << " distinct: " << distinct
+                  << " dropped: " << total.dropped << " seconds: " << seconds
+                  << " GB/s: " << data.size / seconds / 1e9 << std::endl;
+
+    } catch (std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}